@@ -0,0 +1,347 @@
+/*
+ * bootlogd.h	Declarations shared between the bootlogd modules.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+#ifndef BOOTLOGD_H
+#define BOOTLOGD_H
+
+#include <sys/socket.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Longest line we assemble before handing it on in pieces.
+ */
+#define LOGLINE_MAX 4096
+
+/*
+ * Actions a rule can trigger (rules.c).
+ */
+#define ACT_SYNC	0x0001	/* fdatasync the log after this line */
+#define ACT_MARK	0x0002	/* write a marker line into the log */
+#define ACT_COUNT	0x0004	/* only count the match */
+#define ACT_HOOK	0x0008	/* run an external program */
+#define ACT_REDACT	0x0010	/* mask the match (or what follows it) */
+#define ACT_URGENT	0x0020	/* write and sync now, skip the batch window */
+#define ACT_ROUTE	0x0040	/* send the line to another sink as well */
+#define ACT_DETACH	0x0080	/* drain, give the console back and exit */
+
+/*
+ * The stream filter (filter.c).
+ */
+#define FLT_STRIP	0x01	/* remove escape sequences */
+#define FLT_NOCR	0x02	/* drop carriage returns */
+#define FLT_COLLAPSE	0x04	/* CR without NL discards the line so far */
+#define FLT_PRIO	0x08	/* drop lines above maxprio */
+
+/* what filter_run() may add to its input from held back data */
+#define FILTER_SLACK	(LOGLINE_MAX + 8)
+
+struct filter {
+	int flags;		/* FLT_* */
+	int maxprio;		/* for FLT_PRIO */
+	int esc;		/* escape sequence state */
+	int nstr;		/* length of the escape string so far */
+	int bol;		/* at the beginning of a line */
+	int drop;		/* dropping the rest of this line */
+	unsigned char pfx[3];	/* start of the line, priority still unknown */
+	int npfx;
+	int cr;			/* CR seen, waiting for the next byte */
+	int shown;		/* part of the held line went out already */
+	unsigned char hold[LOGLINE_MAX];
+	int nhold;
+	unsigned long dropped;	/* lines dropped by priority */
+	unsigned long collapsed; /* bytes thrown away by FLT_COLLAPSE */
+	int (*run)(struct filter *f, const unsigned char *in, int len,
+			unsigned char *out); /* the copy for these flags */
+};
+
+void filter_init(struct filter *f, int flags, int maxprio);
+int  filter_run(struct filter *f, const unsigned char *in, int len, unsigned char *out);
+int  filter_flush(struct filter *f, unsigned char *out);
+
+/*
+ * The real consoles (console.c).
+ */
+#define MAX_CONSOLES 16
+
+/*
+ * How long a console transform may hold back a partial line (msecs).
+ */
+#define HOLD_MS 250
+
+struct real_cons {
+	char name[1024];
+	int fd;
+	struct filter filt;	/* output transform, see -T */
+	long long held;		/* since when filt holds data back */
+	unsigned long written;	/* bytes written */
+
+	int coalesce;		/* non-blocking, skip what does not fit */
+	int rows;		/* screen height */
+	char *q;		/* output queue */
+	int qlen;
+	int markhead;		/* length of an unsent marker at the head */
+	int atbol;		/* last byte written was a newline */
+	unsigned long pendskip;	/* lines counted in the unsent marker */
+	unsigned long skipped;	/* lines skipped in total */
+	unsigned long qdropped;	/* bytes dropped from a full queue */
+
+	int baud;		/* line speed, 0 if unknown */
+	int charbits;		/* bits per character on the line */
+	int pace;		/* keep the tty buffer short, see -T */
+	int redact;		/* gets the masked lines, not the stream */
+	int pacefill;		/* how much we let the tty buffer hold */
+	long long pacedue;	/* when to look at the tty buffer again */
+	long long lagdue;	/* when to sample the lag again */
+	long lagcur;		/* output lag in msecs, last seen */
+	long lagmax;
+	double lagsum;		/* for the average */
+	unsigned long lagn;
+};
+
+extern struct real_cons cons[];
+extern int num_consoles;
+
+int  parsetrans(char *spec);
+void settrans(struct real_cons *c);
+int  consopen(struct real_cons *c);
+int  consout(struct real_cons *c, int pts, char *p, int m);
+int  consflush(struct real_cons *c, int pts);
+void consopts(struct real_cons *c, char *opts);
+int  constimeout(long long now);
+int  conspace(int pts, long long now);
+void consdrain(struct real_cons *c, int pts);
+
+/*
+ * Record flags, on top of the ACT_* flags of the line.
+ */
+#define REC_NL		0x10000	/* the line ended here */
+#define REC_CONT	0x20000	/* continues the previous record */
+#define REC_PAD		0x40000	/* padding up to the end of the ring */
+
+/*
+ * One assembled line (or piece of a line) in the ring (ring.c).
+ * The text follows the header.
+ */
+struct logrec {
+	unsigned long long seq;	/* record number since we started */
+	struct timespec time;	/* arrival, CLOCK_REALTIME */
+	long long boot;		/* arrival, CLOCK_BOOTTIME usecs, if wanted */
+	unsigned int flags;	/* ACT_* and REC_* */
+	unsigned int route;	/* bit per sink that gets the line */
+	int prio;		/* kernel priority, -1 if none */
+	int len;		/* length of the text */
+};
+#define REC_TEXT(rec) ((char *)((rec) + 1))
+
+struct ringcur {
+	unsigned long long pos;	/* byte position in the ring */
+	unsigned long long seq;	/* next record number expected */
+	unsigned long lost;	/* records dropped before we saw them */
+};
+
+extern unsigned long ringdropped;
+
+struct logrec *ring_append(struct logrec *hdr, const char *text);
+void ring_cursor(struct ringcur *cur);
+struct logrec *ring_next(struct ringcur *cur);
+void ring_advance(struct ringcur *cur, struct logrec *rec);
+
+/*
+ * What the rules decided about one line.
+ */
+struct ruleres {
+	int flags;		/* union of the ACT_* of all matched rules */
+	const char *mark;	/* text of the first matching mark rule */
+	unsigned int route;	/* sinks picked by route rules */
+};
+
+int  rules_load(const char *file);
+int  rules_bind(void);
+void rules_line(unsigned char *line, int len, int cont, struct ruleres *res);
+int  rules_tail(unsigned char *line, int len);
+void rules_reap(void);
+void rules_stats(FILE *fp);
+
+/*
+ * Where the lines go (sink.c). The main logfile is always sink 0.
+ */
+#define MAX_SINKS 16
+
+struct fwd;
+struct spool;
+
+/* longest tag= of a syslog or journal output */
+#define TAG_MAX		64
+
+struct sink {
+	char *name;
+	char *path;
+#ifndef TINY
+	FILE *fp;
+#else
+	int lfd;		/* the logfile, if obuf is set */
+	char *obuf;		/* what is not written to it yet */
+	int olen;
+#endif
+	int all;		/* takes every line */
+	int maxprio;		/* takes lines of this priority or worse, -1 none */
+	int sync;		/* fdatasync after every write */
+	int rotate;		/* rename an existing file to file~ */
+	int json;		/* JSON Lines instead of text */
+	int partial;		/* last line written had no newline */
+	int flushpending;	/* written but not flushed yet */
+	long long lastflush;	/* when we last flushed, mononow() */
+	struct ringcur cur;
+	unsigned long lines;	/* records written */
+
+	/* sinks that send the lines somewhere else than a file */
+	int (*pump)(struct sink *s, int idx);	/* NULL for a logfile */
+	int fd;			/* socket, -1 if not connected */
+	long long retry;	/* next connection attempt, mononow() */
+	int facility;		/* syslog */
+	char *tag;		/* syslog, journal, at most TAG_MAX bytes */
+	int rfc5424;
+	struct fwd *fwd;	/* forwarding, see forward.c */
+	struct spool *spool;	/* spool.c */
+	void (*close)(struct sink *s);	/* at exit, if not just fclose() */
+};
+
+extern struct sink sinks[];
+extern int nsinks;
+extern int createlogfile;
+extern int batchwin;
+extern int boottime;
+
+struct sink *sink_add(char *name, char *path);
+int  sink_parse(char *spec);
+int  sink_find(const char *name);
+unsigned int sink_route(int prio);
+void sink_write(struct sink *s, struct logrec *rec);
+void json_write(struct sink *s, struct logrec *rec);
+void sinks_pump(void);
+int  sinks_timeout(void);
+unsigned long sinks_fallback(const char *path);
+void sink_snapshot(const char *path);
+void sinks_close(void);
+void sinks_stats(FILE *fp);
+
+/*
+ * Forwarding to syslog (syslog.c).
+ */
+int syslog_setup(struct sink *s, char *path);
+int syslog_facility(const char *name);
+int syslog_pump(struct sink *s, int idx);
+
+/*
+ * Forwarding to the systemd journal (journal.c).
+ */
+int journal_setup(struct sink *s, char *path);
+int journal_pump(struct sink *s, int idx);
+
+/*
+ * Forwarding to a collector (forward.c), and the collector (collect.c).
+ */
+#define FWD_FRAME	65536	/* largest frame over a stream */
+#define FWD_HDR		28	/* frame header, without the host name */
+#define FWD_LINE	20	/* line header in a frame */
+#define FWD_ACK		20
+
+int fwd_tcp(struct sink *s, char *where);
+int fwd_udp(struct sink *s, char *where);
+int fwd_unix(struct sink *s, char *where);
+int fwd_addr(char *where, int family, struct sockaddr_storage *addr, socklen_t *len);
+
+int  col_listen(char *spec);
+int  collect(const char *dir, char *statsfile);
+
+/*
+ * A spool of finished chunks (spool.c).
+ */
+int  spool_setup(struct sink *s, char *dir);
+int  spool_option(struct sink *s, char *opt);
+
+/*
+ * The control channel (control.c).
+ */
+extern int ctl_fd;
+
+int  ctl_open(const char *path);
+void ctl_read(void);
+void ctl_close(void);
+
+/*
+ * The boot timeline report (timeline.c).
+ */
+void tl_start(long long now);
+void tl_phase(const char *name, long long now);
+void tl_line(const char *text, int len, long long now);
+void tl_report(const char *file, long long now);
+
+/*
+ * Unit start times (units.c).
+ */
+void units_start(long long now);
+void units_line(const char *s, int len, long long start, long long now);
+void units_report(const char *file, long long now);
+
+/*
+ * Message templates across boots (templates.c).
+ */
+void tpl_start(const char *dir, int keep);
+void tpl_line(const char *s, int len, int prio, long long now);
+void tpl_finish(void);
+
+/*
+ * Latency instrumentation (latency.c).
+ */
+extern int lat_fd;
+
+int  lat_open(void);
+void lat_read(long long nowus);
+void lat_line(const char *s, int len, long long nowus);
+void lat_console(long long us);
+void lat_report(const char *file);
+void lat_close(void);
+
+/*
+ * Take a snapshot of the ring, to the -z file if path is NULL.
+ */
+void snapshot(const char *path);
+
+/*
+ * Why we are leaving, NULL while we are not.
+ */
+extern const char *detaching;
+
+/*
+ * Set by the signal handlers.
+ */
+extern int got_signal;
+extern int got_usr1;
+extern int got_usr2;
+
+extern char *statsfile;
+
+extern int rtprio;
+
+/*
+ * Formatting without stdio (fmt.c).
+ */
+int  fmt_buf(char *buf, int size, const char *fmt, ...);
+void fmt_fd(int fd, const char *fmt, ...);
+const char *fmt_err(int e);
+
+long long mononow(void);
+int parseprio(char *s, int len);
+void rt_undo(void);
+
+#endif
@@ -0,0 +1,859 @@
+/*
+ * collect.c	Collector mode (-A): take in the streams of many hosts.
+ *
+ *		The other end of forward.c. We listen on TCP, UDP or unix
+ *		sockets, all in one epoll loop, and write the lines of each
+ *		stream to a logfile of its own, in the same format as the
+ *		logfile. Streams are told apart by their id, not by the host
+ *		name, which is often "(none)" or "localhost": the first
+ *		stream with a name gets hostdir/name.log, the others
+ *		hostdir/name-id.log while it is still sending. Once it has
+ *		had no connection and no frame for COL_QUIET, a new stream
+ *		with the name takes name.log over: a host that reboots gets
+ *		a new stream id, and keeps its file. Frames are taken only if they follow
+ *		on from what we have of the stream; lines we already have
+ *		are dropped, and the ack tells the sender where we are.
+ *
+ *		Memory is bounded per host and per connection: a host is a
+ *		fixed size record, and a connection holds at most one frame.
+ *		Hosts that have been idle for COL_IDLE are forgotten, so the
+ *		table holds the streams of the last while, not of all time.
+ *		Logfiles are written through stdio and flushed together once
+ *		per batch window (-w); only so many are kept open, the ones
+ *		used the longest ago get closed first.
+ *
+ *		When we run out of fds, a spare one is given up to take
+ *		the connection that is waiting and close it, or the
+ *		listening socket would wake us up again and again. On
+ *		other accept() errors, the socket is left alone for a while.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bootlogd.h"
+
+#define COL_LISTEN	8	/* sockets we listen on */
+#define COL_HOSTS	16384	/* hosts we keep track of, power of two */
+#define COL_FILES	512	/* logfiles kept open */
+#define COL_EVENTS	256	/* events per epoll_wait() */
+#define COL_BUF		4096	/* connection buffer, until a frame needs more */
+#define COL_NAME	64
+#define COL_FILE	(COL_NAME + 17)	/* name-id */
+#define COL_BACKOFF	1000	/* msecs a listening socket is left alone */
+#define COL_QUIET	60000	/* msecs before a new stream may take a name over */
+#define COL_IDLE	3600000	/* msecs before an idle host is forgotten */
+#define COL_SWEEP	60000	/* msecs between looks for idle hosts */
+
+#define CONN_LISTEN	1
+#define CONN_DGRAM	2
+#define CONN_STREAM	3
+
+struct host {
+	char name[COL_NAME];
+	char file[COL_FILE];		/* the logfile, less the .log */
+	unsigned long long stream;	/* the stream we are following */
+	unsigned long long next;	/* the number we want next */
+	struct sink s;			/* the logfile */
+	struct host *newer, *older;	/* open logfiles, last used first */
+	int dirty;			/* written but not flushed */
+	int nconns;			/* stream connections that sent its frames */
+	long long seen;			/* mononow() of its last frame */
+};
+
+struct conn {
+	int kind;			/* CONN_* */
+	int fd;
+	unsigned char *buf;
+	int len, size;
+	long long resume;		/* listening again at mononow(), 0 if listening */
+	struct host *host;		/* whose frames it carries, if known */
+};
+
+static struct {
+	char *spec;
+	int family;
+	int type;
+} listens[COL_LISTEN];
+static int nlistens = 0;
+
+static struct host *hosts[COL_HOSTS];	/* by stream id */
+static struct host *names[COL_HOSTS];	/* by name, the first stream of each */
+static int nhosts = 0;
+static struct host *dirty[COL_HOSTS];	/* to be flushed */
+static int ndirty = 0;
+static struct host *newest, *oldest;	/* open logfiles */
+static int nopen = 0;
+static struct conn *lconns[COL_LISTEN];	/* listening sockets */
+static int nconns = 0;
+static int spare = -1;			/* an fd to give up for accept() */
+static const char *hostdir;
+
+static unsigned long frames = 0;
+static unsigned long lines = 0;
+static unsigned long dupes = 0;		/* lines we already had */
+static unsigned long gaps = 0;		/* frames refused, waiting for a resend */
+static unsigned long lost = 0;		/* lines the senders lost */
+static unsigned long bad = 0;		/* frames that made no sense */
+static unsigned long refused = 0;	/* hosts beyond COL_HOSTS */
+static unsigned long retired = 0;	/* idle hosts forgotten */
+static unsigned long turnedaway = 0;	/* connections we had no fd for */
+
+static void hostclose(struct host *h);
+static void col_sweep(long long now, long long quiet);
+
+/*
+ * Remember a socket to listen on, as tcp:address:port,
+ * udp:address:port or unix:path.
+ */
+int col_listen(char *spec)
+{
+	if (nlistens == COL_LISTEN) {
+		fprintf(stderr, "bootlogd: too many sockets to listen on\n");
+		return -1;
+	}
+	if (strncmp(spec, "tcp:", 4) == 0) {
+		listens[nlistens].family = AF_INET;
+		listens[nlistens].type = SOCK_STREAM;
+	}
+	else if (strncmp(spec, "udp:", 4) == 0) {
+		listens[nlistens].family = AF_INET;
+		listens[nlistens].type = SOCK_DGRAM;
+	}
+	else if (strncmp(spec, "unix:", 5) == 0) {
+		listens[nlistens].family = AF_UNIX;
+		listens[nlistens].type = SOCK_STREAM;
+	}
+	else {
+		fprintf(stderr, "bootlogd: bad socket \"%s\"\n", spec);
+		return -1;
+	}
+	listens[nlistens++].spec = spec;
+
+	return 0;
+}
+
+static unsigned long long get64(unsigned char *p)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		v = v << 8 | p[i];
+	}
+
+	return v;
+}
+
+static void put64(unsigned char *p, unsigned long long v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = v;
+		v >>= 8;
+	}
+}
+
+static unsigned long namehash(const char *s)
+{
+	unsigned long h = 5381;
+
+	while (*s) {
+		h = h * 33 + (unsigned char)*s++;
+	}
+
+	return h;
+}
+
+/*
+ * Where a host would be in hosts[] and names[] if nothing were in
+ * the way.
+ */
+static unsigned long streamslot(struct host *h)
+{
+	return (h->stream ^ h->stream >> 32) & (COL_HOSTS - 1);
+}
+
+static unsigned long nameslot(struct host *h)
+{
+	return namehash(h->name) & (COL_HOSTS - 1);
+}
+
+/*
+ * Take the host at slot i out of a table, moving up the ones after
+ * it that would not be found any more with a hole in the way.
+ */
+static void tabdel(struct host **tab, unsigned long i, unsigned long (*home)(struct host *))
+{
+	unsigned long j = i, k;
+
+	for (;;) {
+		tab[i] = NULL;
+		for (;;) {
+			j = (j + 1) & (COL_HOSTS - 1);
+			if (tab[j] == NULL) {
+				return;
+			}
+			k = home(tab[j]);
+			/* it stays if its home is in (i, j] */
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+				continue;
+			}
+			break;
+		}
+		tab[i] = tab[j];
+		i = j;
+	}
+}
+
+static int hostidle(struct host *h, long long now, long long quiet)
+{
+	return h->nconns == 0 && now - h->seen >= quiet;
+}
+
+/*
+ * The host that sends a stream, by the stream id. A new one is
+ * named by the name it sent, made safe as a file name.
+ */
+static struct host *hostfind(unsigned long long stream, unsigned char *p, int len)
+{
+	char name[COL_NAME];
+	struct host *h, *old;
+	unsigned long i, j;
+	long long now = mononow();
+	int n;
+
+	for (i = (stream ^ stream >> 32) & (COL_HOSTS - 1); hosts[i]; i = (i + 1) & (COL_HOSTS - 1)) {
+		if (hosts[i]->stream == stream) {
+			return hosts[i];
+		}
+	}
+	if (nhosts == COL_HOSTS / 4 * 3) {
+		/* make room, if anybody has gone quiet; the slot may move */
+		col_sweep(now, COL_QUIET);
+		for (i = (stream ^ stream >> 32) & (COL_HOSTS - 1); hosts[i]; i = (i + 1) & (COL_HOSTS - 1))
+			;
+	}
+	if (nhosts == COL_HOSTS / 4 * 3 || (h = calloc(1, sizeof(struct host))) == NULL) {
+		return NULL;
+	}
+
+	for (n = 0; n < len && n < COL_NAME - 1; n++) {
+		name[n] = (p[n] >= 'a' && p[n] <= 'z') || (p[n] >= 'A' && p[n] <= 'Z') ||
+			(p[n] >= '0' && p[n] <= '9') || p[n] == '-' ||
+			(p[n] == '.' && n > 0) ? p[n] : '_';
+	}
+	if (n == 0) {
+		strcpy(name, "unknown");
+	}
+	else {
+		name[n] = 0;
+	}
+	strcpy(h->name, name);
+	h->stream = stream;
+	h->seen = now;
+	h->s.name = h->name;
+	h->s.fd = -1;
+
+	for (j = namehash(name) & (COL_HOSTS - 1); names[j]; j = (j + 1) & (COL_HOSTS - 1)) {
+		if (strcmp(names[j]->name, name) == 0) {
+			break;
+		}
+	}
+	if (names[j] && hostidle(names[j], now, COL_QUIET)) {
+		/* the stream that had the file is done: this one takes over */
+		old = names[j];
+		hostclose(old);
+		snprintf(old->file, sizeof(old->file), "%s-%016llx", old->name, old->stream);
+		strcpy(h->file, name);
+		names[j] = h;
+	}
+	else if (names[j]) {
+		/* the name is taken: the id tells them apart */
+		snprintf(h->file, sizeof(h->file), "%s-%016llx", name, stream);
+	}
+	else {
+		strcpy(h->file, name);
+		names[j] = h;
+	}
+	hosts[i] = h;
+	nhosts++;
+
+	return h;
+}
+
+/*
+ * Keep the open logfiles in the order they were used in.
+ */
+static void lruunlink(struct host *h)
+{
+	if (h->newer) {
+		h->newer->older = h->older;
+	}
+	else {
+		newest = h->older;
+	}
+	if (h->older) {
+		h->older->newer = h->newer;
+	}
+	else {
+		oldest = h->newer;
+	}
+	h->newer = h->older = NULL;
+}
+
+static void lruused(struct host *h)
+{
+	if (h == newest) {
+		return;
+	}
+	if (h->newer) {
+		/* on the list already */
+		lruunlink(h);
+	}
+	h->older = newest;
+	if (newest) {
+		newest->newer = h;
+	}
+	else {
+		oldest = h;
+	}
+	newest = h;
+}
+
+static void hostclose(struct host *h)
+{
+	if (h->s.fp == NULL) {
+		return;
+	}
+	if (h->s.partial) {
+		fputc('\n', h->s.fp);
+		h->s.partial = 0;
+	}
+	/* still dirty (if it was): it is on the list to be flushed */
+	fclose(h->s.fp);
+	h->s.fp = NULL;
+	lruunlink(h);
+	nopen--;
+}
+
+/*
+ * Forget a host: its slot, and its name if it has the name's file.
+ */
+static void hostdrop(struct host *h)
+{
+	unsigned long i;
+
+	hostclose(h);
+	if (h->dirty) {
+		for (i = 0; dirty[i] != h; i++)
+			;
+		dirty[i] = dirty[--ndirty];
+	}
+	for (i = streamslot(h); hosts[i] != h; i = (i + 1) & (COL_HOSTS - 1))
+		;
+	tabdel(hosts, i, streamslot);
+	for (i = nameslot(h); names[i] && names[i] != h; i = (i + 1) & (COL_HOSTS - 1))
+		;
+	if (names[i] == h) {
+		tabdel(names, i, nameslot);
+	}
+	free(h);
+	nhosts--;
+	retired++;
+}
+
+/*
+ * Forget the hosts that have been idle for quiet msecs.
+ */
+static void col_sweep(long long now, long long quiet)
+{
+	unsigned long i;
+
+	for (i = 0; i < COL_HOSTS; i++) {
+		/* what moves up into slot i is looked at too */
+		while (hosts[i] && hostidle(hosts[i], now, quiet)) {
+			hostdrop(hosts[i]);
+		}
+	}
+}
+
+/*
+ * Open the logfile of a host, closing the one used the longest ago
+ * if we have too many open.
+ */
+static int hostopen(struct host *h)
+{
+	char path[1024];
+
+	if (nopen >= COL_FILES && oldest) {
+		hostclose(oldest);
+	}
+	snprintf(path, sizeof(path), "%s/%s.log", hostdir, h->file);
+	if ((h->s.fp = fopen(path, "a")) == NULL) {
+		return -1;
+	}
+	lruused(h);
+	nopen++;
+
+	return 0;
+}
+
+/*
+ * Write out the lines of a frame we have not got yet. Returns the
+ * ack, or 0 if the frame makes no sense.
+ */
+static int col_frame(unsigned char *p, int len, unsigned char *ack, struct host **hp)
+{
+	static unsigned char rbuf[sizeof(struct logrec) + FWD_FRAME];
+	struct logrec *rec = (struct logrec *)rbuf;
+	unsigned long long stream, prev, seq, us;
+	unsigned char *end = p + len;
+	struct host *h;
+	int n, fl, tlen;
+
+	if (len < FWD_HDR || len < FWD_HDR + p[27] || memcmp(p, "BLF1", 4) != 0) {
+		bad++;
+		return 0;
+	}
+	stream = get64(p + 8);
+	prev = get64(p + 16);
+	n = p[24] << 8 | p[25];
+	fl = p[26];
+	if ((h = hostfind(stream, p + FWD_HDR, p[27])) == NULL) {
+		refused++;
+		return 0;
+	}
+	h->seen = mononow();
+	*hp = h;
+	p += FWD_HDR + p[27];
+	frames++;
+
+	if (h->next == 0) {
+		/* a stream we have not seen yet */
+		h->next = prev;
+	}
+	else if (prev > h->next) {
+		if (!(fl & 1)) {
+			/* one went missing, it will be sent again */
+			gaps++;
+			n = 0;
+		}
+		else {
+			h->next = prev;
+		}
+	}
+
+	for (; n > 0; n--) {
+		if (p + FWD_LINE > end || p + FWD_LINE + (p[18] << 8 | p[19]) > end) {
+			bad++;
+			break;
+		}
+		seq = get64(p);
+		tlen = p[18] << 8 | p[19];
+		if (seq < h->next) {
+			dupes++;
+			p += FWD_LINE + tlen;
+			continue;
+		}
+		if (h->s.fp == NULL && hostopen(h) < 0) {
+			break;
+		}
+		lost += seq - h->next;
+		us = get64(p + 8);
+		rec->time.tv_sec = us / 1000000;
+		rec->time.tv_nsec = us % 1000000 * 1000;
+		rec->prio = p[16] == 255 ? -1 : p[16];
+		rec->flags = (p[17] & 1 ? REC_NL : 0) | (p[17] & 2 ? REC_CONT : 0);
+		rec->len = tlen;
+		memcpy(REC_TEXT(rec), p + FWD_LINE, tlen);
+		sink_write(&h->s, rec);
+		h->next = seq + 1;
+		if (!h->dirty) {
+			h->dirty = 1;
+			dirty[ndirty++] = h;
+		}
+		lruused(h);
+		lines++;
+		p += FWD_LINE + tlen;
+	}
+
+	memcpy(ack, "BLA1", 4);
+	put64(ack + 4, h->stream);
+	put64(ack + 12, h->next);
+
+	return FWD_ACK;
+}
+
+static void col_close(int ep, struct conn *c)
+{
+	if (c->host) {
+		c->host->nconns--;
+		c->host->seen = mononow();
+	}
+	epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->buf);
+	free(c);
+	nconns--;
+}
+
+/*
+ * Read what a stream connection has, and take in its frames. Only
+ * the last ack of a read is sent, it covers the ones before.
+ */
+static int col_stream(struct conn *c)
+{
+	unsigned char ack[FWD_ACK];
+	unsigned char *nb;
+	unsigned long flen;
+	struct host *h;
+	int n, off, acklen = 0;
+
+	for (;;) {
+		if (c->size - c->len < COL_BUF / 2 && c->size < FWD_FRAME + 8) {
+			n = c->size * 2 < FWD_FRAME + 8 ? c->size * 2 : FWD_FRAME + 8;
+			if ((nb = realloc(c->buf, n)) == NULL) {
+				return -1;
+			}
+			c->buf = nb;
+			c->size = n;
+		}
+		if ((n = read(c->fd, c->buf + c->len, c->size - c->len)) < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				break;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			return -1;
+		}
+		c->len += n;
+
+		for (off = 0; c->len - off >= 8; off += flen) {
+			flen = 8 + ((unsigned long)c->buf[off + 4] << 24 | c->buf[off + 5] << 16 |
+					c->buf[off + 6] << 8 | c->buf[off + 7]);
+			if (flen > FWD_FRAME + 8 || memcmp(c->buf + off, "BLF1", 4) != 0) {
+				bad++;
+				return -1;
+			}
+			if (c->len - off < (int)flen) {
+				break;
+			}
+			if ((n = col_frame(c->buf + off, flen, ack, &h)) == 0) {
+				return -1;
+			}
+			if (c->host != h) {
+				/* the connection keeps the host from going idle */
+				if (c->host) {
+					c->host->nconns--;
+				}
+				c->host = h;
+				h->nconns++;
+			}
+			acklen = n;
+		}
+		memmove(c->buf, c->buf + off, c->len - off);
+		c->len -= off;
+	}
+	if (acklen) {
+		send(c->fd, ack, acklen, MSG_DONTWAIT|MSG_NOSIGNAL);
+	}
+
+	/* an idle connection does not keep a big buffer */
+	if (c->len == 0 && c->size > COL_BUF && (nb = realloc(c->buf, COL_BUF)) != NULL) {
+		c->buf = nb;
+		c->size = COL_BUF;
+	}
+
+	return 0;
+}
+
+/*
+ * Datagrams, each one a frame: take them in batches.
+ */
+static void col_dgram(struct conn *c)
+{
+	static unsigned char bufs[16][FWD_FRAME + 8];
+	static struct sockaddr_storage from[16];
+	struct mmsghdr msg[16];
+	struct iovec iov[16];
+	unsigned char ack[FWD_ACK];
+	struct host *h;
+	int i, n;
+
+	for (;;) {
+		memset(msg, 0, sizeof(msg));
+		for (i = 0; i < 16; i++) {
+			iov[i].iov_base = bufs[i];
+			iov[i].iov_len = sizeof(bufs[i]);
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+			msg[i].msg_hdr.msg_name = &from[i];
+			msg[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		}
+		if ((n = recvmmsg(c->fd, msg, 16, MSG_DONTWAIT, NULL)) <= 0) {
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			if (col_frame(bufs[i], msg[i].msg_len, ack, &h) > 0) {
+				sendto(c->fd, ack, FWD_ACK, MSG_DONTWAIT, (struct sockaddr *)&from[i],
+						msg[i].msg_hdr.msg_namelen);
+			}
+		}
+	}
+}
+
+static struct conn *col_add(int ep, int fd, int kind)
+{
+	struct epoll_event ev;
+	struct conn *c;
+
+	if ((c = calloc(1, sizeof(struct conn))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	c->fd = fd;
+	c->kind = kind;
+	if (kind == CONN_STREAM && (c->buf = malloc(COL_BUF)) == NULL) {
+		free(c);
+		close(fd);
+		return NULL;
+	}
+	c->size = COL_BUF;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		free(c->buf);
+		free(c);
+		close(fd);
+		return NULL;
+	}
+	if (kind == CONN_STREAM) {
+		nconns++;
+	}
+
+	return c;
+}
+
+/*
+ * Take in the connections that are waiting.
+ */
+static void col_accept(int ep, struct conn *c)
+{
+	struct epoll_event ev;
+	int fd;
+
+	for (;;) {
+		if ((fd = accept4(c->fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+			col_add(ep, fd, CONN_STREAM);
+			continue;
+		}
+		if (errno == EINTR || errno == ECONNABORTED) {
+			continue;
+		}
+		if (errno == EAGAIN) {
+			return;
+		}
+		if ((errno == EMFILE || errno == ENFILE) && spare >= 0) {
+			/* no fd for it: make one, and turn it away */
+			close(spare);
+			if ((fd = accept4(c->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+				close(fd);
+				turnedaway++;
+			}
+			spare = open("/dev/null", O_RDONLY|O_CLOEXEC);
+			if (fd >= 0) {
+				continue;
+			}
+		}
+		break;
+	}
+
+	/* leave it alone for a while */
+	ev.events = 0;
+	ev.data.ptr = c;
+	epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+	c->resume = mononow() + COL_BACKOFF;
+}
+
+/*
+ * Listen again on the sockets that have had their rest. Returns the
+ * msecs until the next one is due, -1 if none.
+ */
+static int col_resume(int ep, long long now)
+{
+	struct epoll_event ev;
+	struct conn *c;
+	int i, tmo = -1;
+
+	for (i = 0; i < nlistens; i++) {
+		if ((c = lconns[i]) == NULL || c->resume == 0) {
+			continue;
+		}
+		if (now >= c->resume) {
+			ev.events = EPOLLIN;
+			ev.data.ptr = c;
+			epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+			c->resume = 0;
+		}
+		else if (tmo < 0 || c->resume - now < tmo) {
+			tmo = c->resume - now;
+		}
+	}
+
+	return tmo;
+}
+
+static int col_open(int ep, int i)
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int fd, on = 1;
+
+	if (fwd_addr(listens[i].spec + (listens[i].family == AF_UNIX ? 5 : 4),
+			listens[i].family, &addr, &len) < 0) {
+		return -1;
+	}
+	if ((fd = socket(addr.ss_family, listens[i].type|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0) {
+		return -1;
+	}
+	if (addr.ss_family == AF_UNIX) {
+		unlink(((struct sockaddr_un *)&addr)->sun_path);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&addr, len) < 0 ||
+			(listens[i].type == SOCK_STREAM && listen(fd, 1024) < 0)) {
+		fprintf(stderr, "bootlogd: %s: %s\n", listens[i].spec, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if ((lconns[i] = col_add(ep, fd, listens[i].type == SOCK_STREAM ? CONN_LISTEN : CONN_DGRAM)) == NULL) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void col_flush(void)
+{
+	int i;
+
+	for (i = 0; i < ndirty; i++) {
+		if (dirty[i]->s.fp) {
+			fflush(dirty[i]->s.fp);
+		}
+		dirty[i]->dirty = 0;
+	}
+	ndirty = 0;
+}
+
+static void col_stats(char *statsfile)
+{
+	FILE *fp;
+
+	if (statsfile == NULL || (fp = fopen(statsfile, "w")) == NULL) {
+		return;
+	}
+	fprintf(fp, "hosts %d refused %lu retired %lu connections %d turned_away %lu open_logs %d\n",
+			nhosts, refused, retired, nconns, turnedaway, nopen);
+	fprintf(fp, "frames %lu lines %lu duplicates %lu gaps %lu lost %lu bad %lu\n",
+			frames, lines, dupes, gaps, lost, bad);
+	fclose(fp);
+}
+
+/*
+ * Run as a collector until we are told to stop.
+ */
+int collect(const char *dir, char *statsfile)
+{
+	struct epoll_event evs[COL_EVENTS];
+	struct rlimit rl;
+	struct conn *c;
+	long long lastflush = 0, lastsweep = 0, now;
+	int ep, i, n, tmo, rtmo;
+
+	hostdir = dir;
+	/* a connection per host, and the logfiles */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		fprintf(stderr, "bootlogd: epoll: %s\n", strerror(errno));
+		return 1;
+	}
+	for (i = 0; i < nlistens; i++) {
+		if (col_open(ep, i) < 0) {
+			return 1;
+		}
+	}
+	spare = open("/dev/null", O_RDONLY|O_CLOEXEC);
+
+	while (!got_signal) {
+		tmo = -1;
+		if (ndirty) {
+			tmo = lastflush + batchwin - mononow();
+			tmo = tmo < 0 ? 0 : tmo;
+		}
+		if ((rtmo = col_resume(ep, mononow())) >= 0 && (tmo < 0 || rtmo < tmo)) {
+			tmo = rtmo;
+		}
+		if ((n = epoll_wait(ep, evs, COL_EVENTS, tmo)) < 0 && errno != EINTR) {
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			c = evs[i].data.ptr;
+			if (c->kind == CONN_LISTEN) {
+				col_accept(ep, c);
+			}
+			else if (c->kind == CONN_DGRAM) {
+				col_dgram(c);
+			}
+			else if (col_stream(c) < 0) {
+				col_close(ep, c);
+			}
+		}
+
+		now = mononow();
+		if (now - lastflush >= batchwin) {
+			col_flush();
+			lastflush = now;
+		}
+		if (now - lastsweep >= COL_SWEEP) {
+			col_sweep(now, COL_IDLE);
+			lastsweep = now;
+		}
+		if (got_usr1) {
+			got_usr1 = 0;
+			col_stats(statsfile);
+		}
+	}
+
+	for (i = 0; i < COL_HOSTS; i++) {
+		if (hosts[i]) {
+			hostclose(hosts[i]);
+		}
+	}
+	col_stats(statsfile);
+
+	return 0;
+}
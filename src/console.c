@@ -0,0 +1,630 @@
+/*
+ * console.c	Writing to the real console(s).
+ *
+ *		By default a console is written synchronously, as it always
+ *		was. A console set up with the coalesce transform is written
+ *		without blocking instead: what it cannot take right away is
+ *		queued, and when the queue holds more than a screenful, the
+ *		lines that would scroll off before anyone could read them are
+ *		dropped and replaced with a "[N lines skipped]" marker. That
+ *		keeps a slow framebuffer console from holding up everything
+ *		else; the logfiles still get the full output.
+ *
+ *		A console set up with the pace transform is written without
+ *		blocking as well, but never faster than the line can take:
+ *		we only top up the tty output buffer (TIOCOUTQ) to about
+ *		PACE_MS worth of characters at the line speed from the
+ *		console= option, and come back when it has drained. For all
+ *		consoles with a known speed, the time it will take to get
+ *		the pending output out of the line is kept as the "lag".
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 1991-2004 Miquel van Smoorenburg.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <termios.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bootlogd.h"
+
+/*
+ * Size of the output queue of a coalescing console, how much of it is
+ * kept free for a marker, and the screen height we assume if the
+ * console does not tell us.
+ */
+#define CONSQ_SIZE	65536
+#define CONSQ_SLACK	64
+#define CONSQ_FILL	(CONSQ_SIZE - CONSQ_SLACK)
+#define DEFAULT_ROWS	25
+
+/*
+ * How much output (in msecs at line speed) a paced console may have
+ * waiting in the tty buffer, and the least we ever let it have.
+ */
+#define PACE_MS		50
+#define PACE_MIN	64
+
+/*
+ * How often to sample the lag of a console that is written the old
+ * way (msecs); asking the tty after every write costs a syscall.
+ */
+#define LAG_MS		100
+
+/*
+ * Line speeds we know the termios constant of.
+ */
+static struct speed {
+	speed_t code;
+	int baud;
+} speeds[] = {
+	{ B1200, 1200 },     { B2400, 2400 },     { B4800, 4800 },
+	{ B9600, 9600 },     { B19200, 19200 },   { B38400, 38400 },
+	{ B57600, 57600 },   { B115200, 115200 }, { B230400, 230400 },
+	{ B460800, 460800 }, { B921600, 921600 }, { 0, 0 },
+};
+
+/*
+ * Console output transforms, as given with -T.
+ */
+static struct constrans {
+	char *name;
+	int flags;
+	int maxprio;
+	int coalesce;
+	int pace;
+	int redact;
+} constrans[MAX_CONSOLES];
+static int num_constrans = 0;
+
+/*
+ * Parse a console transform given as console=transform[,transform...].
+ */
+int parsetrans(char *spec)
+{
+	struct constrans *t;
+	char *opt, *next;
+
+	if (num_constrans == MAX_CONSOLES || (spec = strdup(spec)) == NULL ||
+			(opt = strchr(spec, '=')) == NULL || opt == spec) {
+		fmt_fd(2, "bootlogd: bad console transform \"%s\"\n", spec);
+		return -1;
+	}
+	*opt++ = 0;
+	t = &constrans[num_constrans++];
+	t->name = spec;
+	t->flags = 0;
+	t->maxprio = 7;
+	t->coalesce = 0;
+	t->pace = 0;
+	t->redact = 0;
+
+	for (; opt; opt = next) {
+		if ((next = strchr(opt, ',')) != NULL) {
+			*next++ = 0;
+		}
+		if (strcmp(opt, "raw") == 0) {
+			t->flags = 0;
+		}
+		else if (strcmp(opt, "strip") == 0) {
+			t->flags |= FLT_STRIP;
+		}
+		else if (strcmp(opt, "collapse") == 0) {
+			t->flags |= FLT_COLLAPSE;
+		}
+		else if (strcmp(opt, "coalesce") == 0) {
+			t->coalesce = 1;
+		}
+		else if (strcmp(opt, "pace") == 0) {
+			t->pace = 1;
+		}
+		else if (strcmp(opt, "redact") == 0) {
+			t->redact = 1;
+		}
+		else if (strncmp(opt, "prio=", 5) == 0 && opt[5] >= '0' && opt[5] <= '7' && opt[6] == 0) {
+			t->flags |= FLT_PRIO;
+			t->maxprio = opt[5] - '0';
+		}
+		else {
+			fmt_fd(2, "bootlogd: %s: unknown transform \"%s\"\n", spec, opt);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Set up the output transform of a console. The transform can name
+ * the console by its device (/dev/ttyS0) or as on the kernel command
+ * line (ttyS0).
+ */
+void settrans(struct real_cons *c)
+{
+	char *base;
+	int i;
+
+	filter_init(&c->filt, 0, 7);
+	c->coalesce = 0;
+	c->pace = 0;
+	c->redact = 0;
+	base = strrchr(c->name, '/');
+	base = base ? base + 1 : c->name;
+	for (i = 0; i < num_constrans; i++) {
+		if (strcmp(constrans[i].name, c->name) == 0 || strcmp(constrans[i].name, base) == 0) {
+			filter_init(&c->filt, constrans[i].flags, constrans[i].maxprio);
+			c->coalesce = constrans[i].coalesce;
+			c->pace = constrans[i].pace;
+			c->redact = constrans[i].redact;
+		}
+	}
+}
+
+static int open_nb(char *buf)
+{
+	int fd, n;
+
+	if ((fd = open(buf, O_WRONLY|O_NONBLOCK|O_NOCTTY)) < 0) {
+		return -1;
+	}
+	n = fcntl(fd, F_GETFL);
+	n &= ~(O_NONBLOCK);
+	fcntl(fd, F_SETFL, n);
+
+	return fd;
+}
+
+/*
+ * Line settings from the console= option, as in "115200n8".
+ */
+void consopts(struct real_cons *c, char *opts)
+{
+	char *p;
+	int bits = 8;
+	int parity = 0;
+
+	c->baud = strtol(opts, &p, 10);
+	if (*p == 'n' || *p == 'o' || *p == 'e') {
+		parity = (*p != 'n');
+		p++;
+		if (*p >= '5' && *p <= '8') {
+			bits = *p - '0';
+		}
+	}
+	/* start bit, data bits, parity, stop bit */
+	c->charbits = 1 + bits + parity + 1;
+}
+
+/*
+ * Characters per second the console line moves, 0 if unknown.
+ */
+static int byterate(struct real_cons *c)
+{
+	if (c->baud <= 0) {
+		return 0;
+	}
+
+	return c->baud / (c->charbits ? c->charbits : 10);
+}
+
+/*
+ * Note how long it will take to get what is pending out of the line.
+ */
+static void lagsample(struct real_cons *c, int outq)
+{
+	int rate;
+
+	if ((rate = byterate(c)) == 0) {
+		return;
+	}
+	c->lagcur = (long)(outq + c->qlen) * 1000 / rate;
+	if (c->lagcur > c->lagmax) {
+		c->lagmax = c->lagcur;
+	}
+	c->lagsum += c->lagcur;
+	c->lagn++;
+}
+
+/*
+ * A virtual terminal (tty0 to tty63) claims a line speed, B38400,
+ * but there is no line.
+ */
+static int isvt(int fd)
+{
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && S_ISCHR(st.st_mode) &&
+		major(st.st_rdev) == 4 && minor(st.st_rdev) < 64;
+}
+
+/*
+ * Open a real console. Coalescing and paced consoles stay non-blocking
+ * and get their output queue.
+ */
+int consopen(struct real_cons *c)
+{
+	struct winsize ws;
+	struct termios tio;
+	struct speed *sp;
+
+	if ((c->fd = open_nb(c->name)) < 0) {
+		return -1;
+	}
+	c->atbol = 1;
+
+	/*
+	 * No speed on the command line: ask the line itself.
+	 * Virtual terminals don't have one that means anything.
+	 */
+	if (isvt(c->fd)) {
+		c->baud = 0;
+	}
+	else if (c->baud == 0 && tcgetattr(c->fd, &tio) == 0) {
+		for (sp = speeds; sp->baud; sp++) {
+			if (sp->code == cfgetospeed(&tio)) {
+				c->baud = sp->baud;
+				c->charbits = 1 + 8 + ((tio.c_cflag & PARENB) ? 1 : 0) +
+					((tio.c_cflag & CSTOPB) ? 2 : 1);
+			}
+		}
+	}
+	if (c->pace && byterate(c) == 0) {
+		fmt_fd(2, "bootlogd: %s: line speed unknown, not pacing\n", c->name);
+		c->pace = 0;
+	}
+	if (!c->coalesce && !c->pace) {
+		return c->fd;
+	}
+
+	c->rows = DEFAULT_ROWS;
+	if (ioctl(c->fd, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 1) {
+		c->rows = ws.ws_row;
+	}
+	c->pacefill = byterate(c) * PACE_MS / 1000;
+	if (c->pacefill < PACE_MIN) {
+		c->pacefill = PACE_MIN;
+	}
+	if (c->q == NULL && (c->q = malloc(CONSQ_SIZE)) == NULL) {
+		/* no queue: write it the old way */
+		c->coalesce = 0;
+		c->pace = 0;
+		return c->fd;
+	}
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+	return c->fd;
+}
+
+/*
+ * We got a write error on the real console. If its an EIO,
+ * somebody hung up our filedescriptor, so try to re-open it.
+ */
+static int write_err(int pts, int realfd, char *realcons, int e)
+{
+	int fd;
+
+	if (e != EIO) {
+werr:
+		close(pts);
+		fmt_fd(2, "bootlogd: writing to console: %s\n", fmt_err(e));
+
+		return -1;
+	}
+	close(realfd);
+	if ((fd = open_nb(realcons)) < 0) {
+		goto werr;
+	}
+
+	return fd;
+}
+
+/*
+ * Write data (in chunks if needed) to a real console.
+ * Returns -1 if we lost the console for good.
+ */
+static int conswrite(struct real_cons *c, int pts, char *p, int m)
+{
+	long long now;
+	int i, outq;
+
+	c->written += m;
+	while (m > 0) {
+		i = write(c->fd, p, m);
+		if (i >= 0) {
+			m -= i;
+			p += i;
+			continue;
+		}
+		/*
+		 * Handle EIO (somebody hung
+		 * up our filedescriptor)
+		 */
+		c->fd = write_err(pts, c->fd, c->name, errno);
+		if (c->fd < 0) {
+			return -1;
+		}
+	}
+	if (c->baud && (now = mononow()) >= c->lagdue) {
+		c->lagdue = now + LAG_MS;
+		if (ioctl(c->fd, TIOCOUTQ, &outq) == 0) {
+			lagsample(c, outq);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Replace the head of the queue, up to cut, with a marker for skip
+ * more lines. A marker that was not started yet is merged.
+ */
+static void putmark(struct real_cons *c, int cut, int skip)
+{
+	char mark[CONSQ_SLACK];
+	int mlen;
+
+	c->skipped += skip;
+	c->pendskip += skip;
+	mlen = fmt_buf(mark, sizeof(mark), "%s[%lu lines skipped]\n",
+			c->atbol ? "" : "\n", c->pendskip);
+	memmove(c->q + mlen, c->q + cut, c->qlen - cut);
+	memcpy(c->q, mark, mlen);
+	c->qlen = mlen + c->qlen - cut;
+	c->markhead = mlen;
+}
+
+/*
+ * Keep no more than a screenful of lines in the queue. The lines cut
+ * out are replaced by a marker at the head of the queue.
+ */
+static void coalesce(struct real_cons *c)
+{
+	int nl, skip, cut, i, k;
+
+	nl = 0;
+	for (i = c->markhead; i < c->qlen; i++) {
+		if (c->q[i] == '\n') {
+			nl++;
+		}
+	}
+	if (nl < c->rows) {
+		return;
+	}
+
+	/*
+	 * Keep rows - 1 lines, the marker takes the last row.
+	 */
+	skip = nl - (c->rows - 1);
+	for (i = c->markhead, k = 0; i < c->qlen; i++) {
+		if (c->q[i] == '\n' && ++k == skip) {
+			break;
+		}
+	}
+	cut = i + 1;
+
+	putmark(c, cut, skip);
+}
+
+/*
+ * The queue is full, of a screenful of very long lines or of what a
+ * paced console could not get out: make room the hard way. The oldest
+ * half goes, up to the end of a line, and a marker takes its place.
+ */
+static void qdrop(struct real_cons *c)
+{
+	char *nl;
+	int cut, skip, i;
+
+	cut = c->markhead + (c->qlen - c->markhead) / 2;
+	if ((nl = memchr(c->q + cut, '\n', c->qlen - cut)) != NULL) {
+		cut = nl - c->q + 1;
+	}
+	else {
+		cut = c->qlen;
+	}
+	skip = 0;
+	for (i = c->markhead; i < cut; i++) {
+		if (c->q[i] == '\n') {
+			skip++;
+		}
+	}
+	if (c->q[cut - 1] != '\n') {
+		/* the start of a line, the rest is still to come */
+		skip++;
+	}
+	c->qdropped += cut - c->markhead;
+	putmark(c, cut, skip);
+}
+
+/*
+ * Write up to limit bytes of the queue, as much as the console takes
+ * without blocking. Returns -1 if we lost the console for good.
+ */
+static int qwrite(struct real_cons *c, int pts, int limit)
+{
+	int n;
+
+	while (c->qlen > 0 && limit > 0) {
+		n = write(c->fd, c->q, c->qlen < limit ? c->qlen : limit);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				return 0;
+			}
+			if ((c->fd = write_err(pts, c->fd, c->name, errno)) < 0) {
+				return -1;
+			}
+			fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+			continue;
+		}
+		if (n == 0) {
+			return 0;
+		}
+		c->atbol = (c->q[n - 1] == '\n');
+		if (c->markhead) {
+			/* the marker is on its way, don't touch it again */
+			c->markhead = 0;
+			c->pendskip = 0;
+		}
+		c->qlen -= n;
+		limit -= n;
+		memmove(c->q, c->q + n, c->qlen);
+	}
+
+	return 0;
+}
+
+/*
+ * Top up the tty buffer of a paced console, and work out when to
+ * come back: when about half of what it holds has gone out.
+ */
+static int paceflush(struct real_cons *c, int pts, long long now)
+{
+	int outq = 0;
+	int room;
+
+	if (ioctl(c->fd, TIOCOUTQ, &outq) < 0) {
+		outq = 0;
+	}
+	room = c->pacefill - outq;
+	if (room > 0 && qwrite(c, pts, room) < 0) {
+		return -1;
+	}
+	if (ioctl(c->fd, TIOCOUTQ, &outq) < 0) {
+		outq = 0;
+	}
+	lagsample(c, outq);
+	c->pacedue = now + 1 + (long long)(outq > c->pacefill / 2 ? outq - c->pacefill / 2 : 0) * 1000 / byterate(c);
+
+	return 0;
+}
+
+/*
+ * Write as much of the queue as the console takes without blocking.
+ * Returns -1 if we lost the console for good.
+ */
+int consflush(struct real_cons *c, int pts)
+{
+	if (c->pace) {
+		return paceflush(c, pts, mononow());
+	}
+
+	return qwrite(c, pts, c->qlen);
+}
+
+/*
+ * Milliseconds until a paced console wants our attention, -1 if none.
+ */
+int constimeout(long long now)
+{
+	int tmo = -1;
+	long long left;
+	int i;
+
+	for (i = 0; i < num_consoles; i++) {
+		if (cons[i].fd < 0 || !cons[i].pace || cons[i].qlen == 0) {
+			continue;
+		}
+		left = cons[i].pacedue - now;
+		if (left < 0) {
+			left = 0;
+		}
+		if (tmo < 0 || left < tmo) {
+			tmo = left;
+		}
+	}
+
+	return tmo;
+}
+
+/*
+ * Feed the paced consoles that are due. Returns the number of
+ * consoles lost on the way.
+ */
+int conspace(int pts, long long now)
+{
+	int lost = 0;
+	int i;
+
+	for (i = 0; i < num_consoles; i++) {
+		if (cons[i].fd < 0 || !cons[i].pace || cons[i].qlen == 0 || now < cons[i].pacedue) {
+			continue;
+		}
+		if (paceflush(&cons[i], pts, now) < 0) {
+			lost++;
+		}
+	}
+
+	return lost;
+}
+
+/*
+ * Queue data for a coalescing console, then write what we can.
+ */
+static int consqueue(struct real_cons *c, int pts, char *p, int m)
+{
+	int n;
+
+	while (m > 0) {
+		if (c->qlen >= CONSQ_FILL) {
+			qdrop(c);
+		}
+		/* a marker may have grown the queue past the fill mark */
+		n = CONSQ_FILL - c->qlen;
+		if (n < 0) {
+			n = 0;
+		}
+		if (n > m) {
+			n = m;
+		}
+		memcpy(c->q + c->qlen, p, n);
+		c->qlen += n;
+		p += n;
+		m -= n;
+		if (c->coalesce) {
+			coalesce(c);
+		}
+	}
+	if (c->pace && mononow() < c->pacedue) {
+		return 0;
+	}
+
+	return consflush(c, pts);
+}
+
+/*
+ * Send data to a real console, the way it is set up for.
+ * Returns -1 if we lost the console for good.
+ */
+int consout(struct real_cons *c, int pts, char *p, int m)
+{
+	if (!c->coalesce && !c->pace) {
+		return conswrite(c, pts, p, m);
+	}
+	c->written += m;
+
+	return consqueue(c, pts, p, m);
+}
+
+/*
+ * On the way out: give the console what is left in its queue,
+ * waiting for it this time.
+ */
+void consdrain(struct real_cons *c, int pts)
+{
+	if (c->fd < 0 || (!c->coalesce && !c->pace) || c->qlen == 0) {
+		return;
+	}
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+	qwrite(c, pts, c->qlen);
+}
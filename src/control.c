@@ -0,0 +1,149 @@
+/*
+ * control.c	The control channel (-f).
+ *
+ *		A FIFO that init scripts can write commands to, one per
+ *		line, as in "echo detach > /run/bootlogd.ctl" or
+ *		"echo phase cryptsetup > /run/bootlogd.ctl". We keep it
+ *		open for writing ourselves, so it never reads as closed
+ *		between two writers. Partial commands are kept until the
+ *		rest comes in; a line that does not fit is thrown away.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bootlogd.h"
+
+#define CTL_LINE	256
+
+int ctl_fd = -1;
+static const char *ctl_path;
+static char ctlbuf[CTL_LINE];
+static int ctllen = 0;
+static int ctltoolong = 0;
+
+static void ctl_detach(char *arg)
+{
+	(void)arg;
+	if (detaching == NULL) {
+		detaching = "control";
+	}
+}
+
+static void ctl_phase(char *arg)
+{
+	tl_phase(arg, mononow());
+}
+
+static void ctl_snapshot(char *arg)
+{
+	snapshot(arg && *arg ? arg : NULL);
+}
+
+static struct ctlcmd {
+	char *name;
+	void (*fn)(char *arg);
+} ctlcmds[] = {
+	{ "detach", ctl_detach },
+	{ "phase",  ctl_phase  },
+	{ "snapshot", ctl_snapshot },
+	{ NULL,     NULL       },
+};
+
+/*
+ * Create (if need be) and open the control FIFO.
+ */
+int ctl_open(const char *path)
+{
+	struct stat st;
+
+	if (mkfifo(path, 0600) < 0 && errno != EEXIST) {
+		fprintf(stderr, "bootlogd: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (stat(path, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+		fprintf(stderr, "bootlogd: %s: not a FIFO\n", path);
+		return -1;
+	}
+	if ((ctl_fd = open(path, O_RDWR|O_NONBLOCK)) < 0) {
+		fprintf(stderr, "bootlogd: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	ctl_path = path;
+
+	return ctl_fd;
+}
+
+static void ctl_command(char *line)
+{
+	struct ctlcmd *c;
+	char *arg;
+
+	if ((arg = strchr(line, ' ')) != NULL) {
+		*arg++ = 0;
+		arg += strspn(arg, " ");
+	}
+	/* "phase: name" reads as well as "phase name" */
+	if (*line && line[strlen(line) - 1] == ':') {
+		line[strlen(line) - 1] = 0;
+	}
+	for (c = ctlcmds; c->name; c++) {
+		if (strcmp(c->name, line) == 0) {
+			c->fn(arg);
+			return;
+		}
+	}
+	if (*line) {
+		fprintf(stderr, "bootlogd: unknown control command \"%s\"\n", line);
+	}
+}
+
+/*
+ * Take in what was written to the FIFO, and act on complete lines.
+ */
+void ctl_read(void)
+{
+	char buf[CTL_LINE];
+	int i, n;
+
+	if ((n = read(ctl_fd, buf, sizeof(buf))) <= 0) {
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (buf[i] == '\n') {
+			ctlbuf[ctllen] = 0;
+			if (!ctltoolong) {
+				ctl_command(ctlbuf);
+			}
+			ctllen = 0;
+			ctltoolong = 0;
+		}
+		else if (ctllen < CTL_LINE - 1) {
+			ctlbuf[ctllen++] = buf[i];
+		}
+		else {
+			ctltoolong = 1;
+		}
+	}
+}
+
+void ctl_close(void)
+{
+	if (ctl_fd < 0) {
+		return;
+	}
+	close(ctl_fd);
+	unlink(ctl_path);
+	ctl_fd = -1;
+}
@@ -0,0 +1,190 @@
+/*
+ * filter.c	The byte stream filter shared by the log and the consoles.
+ *
+ *		It removes escape sequences, deals with carriage returns and
+ *		can drop lines by kernel priority. Everything is done one byte
+ *		at a time with all state kept in struct filter, so data can be
+ *		cut anywhere between two calls.
+ *
+ *		With FLT_COLLAPSE the current line is held back, and a
+ *		carriage return that is not followed by a newline throws away
+ *		what came before it: a progress bar that redraws itself only
+ *		costs the last redraw. The caller gets the held text with
+ *		filter_flush() when it does not want to wait any longer.
+ *
+ *		There is a copy of the filter for each combination of flags
+ *		(see filtergen.h), picked by filter_init(), so the byte loop
+ *		does not test for options that are off, and plain text goes
+ *		through a run at a time.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <string.h>
+#include "bootlogd.h"
+
+/*
+ * Escape sequence states.
+ */
+#define ESC_NONE	0
+#define ESC_START	1	/* just saw ESC */
+#define ESC_CSI		2	/* ESC [ parameters */
+#define ESC_STRING	3	/* OSC, DCS, ... up to BEL or ESC \ */
+#define ESC_STRESC	4	/* ESC inside a string, maybe ST */
+#define ESC_INTER	5	/* ESC intermediate bytes */
+
+/*
+ * A string that runs past a newline, or longer than this, was never
+ * a string: a stray ESC ] must not swallow the rest of the boot.
+ */
+#define ESC_STRING_MAX	1024
+
+/*
+ * Add n plain bytes to the held line, letting out what will not fit.
+ */
+static unsigned char *puthold(struct filter *f, const unsigned char *s, int n, unsigned char *o)
+{
+	int m;
+
+	while (n > 0) {
+		if (f->nhold == sizeof(f->hold)) {
+			memcpy(o, f->hold, f->nhold);
+			o += f->nhold;
+			f->nhold = 0;
+			f->shown = 1;
+		}
+		m = sizeof(f->hold) - f->nhold;
+		if (m > n) {
+			m = n;
+		}
+		memcpy(f->hold + f->nhold, s, m);
+		f->nhold += m;
+		s += m;
+		n -= m;
+	}
+
+	return o;
+}
+
+/*
+ * The copies: FLT_FLAGS is the flags, the names get it as a suffix.
+ */
+#define FLT_FLAGS	0
+#define FLT_NAME(x)	x##0
+#include "filtergen.h"
+
+#define FLT_FLAGS	1
+#define FLT_NAME(x)	x##1
+#include "filtergen.h"
+
+#define FLT_FLAGS	2
+#define FLT_NAME(x)	x##2
+#include "filtergen.h"
+
+#define FLT_FLAGS	3
+#define FLT_NAME(x)	x##3
+#include "filtergen.h"
+
+#define FLT_FLAGS	4
+#define FLT_NAME(x)	x##4
+#include "filtergen.h"
+
+#define FLT_FLAGS	5
+#define FLT_NAME(x)	x##5
+#include "filtergen.h"
+
+#define FLT_FLAGS	6
+#define FLT_NAME(x)	x##6
+#include "filtergen.h"
+
+#define FLT_FLAGS	7
+#define FLT_NAME(x)	x##7
+#include "filtergen.h"
+
+#define FLT_FLAGS	8
+#define FLT_NAME(x)	x##8
+#include "filtergen.h"
+
+#define FLT_FLAGS	9
+#define FLT_NAME(x)	x##9
+#include "filtergen.h"
+
+#define FLT_FLAGS	10
+#define FLT_NAME(x)	x##10
+#include "filtergen.h"
+
+#define FLT_FLAGS	11
+#define FLT_NAME(x)	x##11
+#include "filtergen.h"
+
+#define FLT_FLAGS	12
+#define FLT_NAME(x)	x##12
+#include "filtergen.h"
+
+#define FLT_FLAGS	13
+#define FLT_NAME(x)	x##13
+#include "filtergen.h"
+
+#define FLT_FLAGS	14
+#define FLT_NAME(x)	x##14
+#include "filtergen.h"
+
+#define FLT_FLAGS	15
+#define FLT_NAME(x)	x##15
+#include "filtergen.h"
+
+typedef int (*filter_fn)(struct filter *f, const unsigned char *in, int len, unsigned char *out);
+
+static filter_fn runs[16] = {
+	run0, run1, run2, run3, run4, run5, run6, run7,
+	run8, run9, run10, run11, run12, run13, run14, run15,
+};
+
+void filter_init(struct filter *f, int flags, int maxprio)
+{
+	memset(f, 0, sizeof(*f));
+	f->flags = flags;
+	f->maxprio = maxprio;
+	f->bol = 1;
+	f->run = runs[flags & 15];
+}
+
+/*
+ * Run a chunk of data through the filter. out must have room for
+ * len bytes plus what the filter may be holding back (FILTER_SLACK).
+ * Returns the number of bytes put in out.
+ */
+int filter_run(struct filter *f, const unsigned char *in, int len, unsigned char *out)
+{
+	return f->run(f, in, len, out);
+}
+
+/*
+ * Hand out what the filter is holding back.
+ */
+int filter_flush(struct filter *f, unsigned char *out)
+{
+	int n = 0;
+
+	if (f->npfx && f->bol) {
+		/* too early to tell the priority, let it through */
+		memcpy(out, f->pfx, f->npfx);
+		n = f->npfx;
+		f->npfx = 0;
+		f->bol = 0;
+	}
+	if (f->nhold) {
+		memcpy(out + n, f->hold, f->nhold);
+		n += f->nhold;
+		f->nhold = 0;
+		f->shown = 1;
+	}
+
+	return n;
+}
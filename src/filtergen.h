@@ -0,0 +1,233 @@
+/*
+ * filtergen.h	The body of the stream filter, included by filter.c once
+ *		for each combination of FLT_* flags.
+ *
+ *		Before each include, FLT_FLAGS is set to the flags and
+ *		FLT_NAME(x) to a macro that gives the names of this copy
+ *		their own suffix. With the flags a constant, the compiler
+ *		drops the tests on them, and the code for whatever is off,
+ *		from the byte loop.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+/*
+ * Last stage: carriage returns and the held line.
+ */
+static unsigned char *FLT_NAME(putcr)(struct filter *f, int c, unsigned char *o)
+{
+	if (!(FLT_FLAGS & FLT_COLLAPSE)) {
+		if (c != '\r' || !(FLT_FLAGS & FLT_NOCR)) {
+			*o++ = c;
+		}
+		return o;
+	}
+
+	if (f->cr) {
+		f->cr = 0;
+		if (c == '\n') {
+			memcpy(o, f->hold, f->nhold);
+			o += f->nhold;
+			*o++ = '\r';
+			*o++ = '\n';
+			f->nhold = 0;
+			f->shown = 0;
+			return o;
+		}
+		/*
+		 * The line is being redrawn. If part of it is on the
+		 * screen already, the terminal needs the CR as well.
+		 */
+		f->collapsed += f->nhold;
+		f->nhold = 0;
+		if (f->shown) {
+			*o++ = '\r';
+			f->shown = 0;
+		}
+	}
+	if (c == '\r') {
+		f->cr = 1;
+		return o;
+	}
+	if (c == '\n') {
+		memcpy(o, f->hold, f->nhold);
+		o += f->nhold;
+		*o++ = '\n';
+		f->nhold = 0;
+		f->shown = 0;
+		return o;
+	}
+	if (f->nhold == sizeof(f->hold)) {
+		memcpy(o, f->hold, f->nhold);
+		o += f->nhold;
+		f->nhold = 0;
+		f->shown = 1;
+	}
+	f->hold[f->nhold++] = c;
+
+	return o;
+}
+
+/*
+ * Middle stage: drop lines above the wanted priority. We may have to
+ * look at up to three bytes before we know.
+ */
+static unsigned char *FLT_NAME(putprio)(struct filter *f, int c, unsigned char *o)
+{
+	int i, prio;
+
+	if (!(FLT_FLAGS & FLT_PRIO)) {
+		return FLT_NAME(putcr)(f, c, o);
+	}
+	if (f->bol) {
+		f->pfx[f->npfx++] = c;
+		if (f->npfx < 3 && f->pfx[0] == '<' && c != '\n') {
+			return o;
+		}
+		f->bol = 0;
+		prio = parseprio((char *)f->pfx, f->npfx);
+		f->drop = (prio > f->maxprio);
+		if (f->drop) {
+			f->dropped++;
+		}
+		/* only the last of them can be a newline */
+		for (i = 0; i < f->npfx; i++) {
+			if (!f->drop) {
+				o = FLT_NAME(putcr)(f, f->pfx[i], o);
+			}
+		}
+		if (c == '\n') {
+			f->bol = 1;
+			f->drop = 0;
+		}
+		f->npfx = 0;
+		return o;
+	}
+	if (!f->drop) {
+		o = FLT_NAME(putcr)(f, c, o);
+	}
+	if (c == '\n') {
+		f->bol = 1;
+		f->drop = 0;
+	}
+
+	return o;
+}
+
+static int FLT_NAME(run)(struct filter *f, const unsigned char *in, int len, unsigned char *out)
+{
+	unsigned char *o = out;
+	int i, c, start;
+
+	for (i = 0; i < len; i++) {
+		/*
+		 * Most bytes are plain text, which goes through as it
+		 * is (or goes, in a dropped line, or is held): take them
+		 * a run at a time, up to the next byte that means
+		 * something.
+		 */
+		if ((!(FLT_FLAGS & FLT_STRIP) || f->esc == ESC_NONE) &&
+				(!(FLT_FLAGS & FLT_PRIO) || !f->bol) &&
+				(!(FLT_FLAGS & FLT_COLLAPSE) || !f->cr)) {
+			start = i;
+			while (i < len && !((FLT_FLAGS & FLT_STRIP) && in[i] == 27) &&
+					!((FLT_FLAGS & (FLT_NOCR|FLT_COLLAPSE)) && in[i] == '\r') &&
+					!((FLT_FLAGS & (FLT_PRIO|FLT_COLLAPSE)) && in[i] == '\n')) {
+				i++;
+			}
+			if (!(FLT_FLAGS & FLT_PRIO) || !f->drop) {
+				if (FLT_FLAGS & FLT_COLLAPSE) {
+					o = puthold(f, in + start, i - start, o);
+				}
+				else {
+					memcpy(o, in + start, i - start);
+					o += i - start;
+				}
+			}
+			if (i == len) {
+				break;
+			}
+		}
+		c = in[i];
+
+		if (FLT_FLAGS & FLT_STRIP) {
+			switch (f->esc) {
+				case ESC_STRESC:
+					if (c == '\\') {
+						f->esc = ESC_NONE;
+						continue;
+					}
+					/* fall through - ESC starts a new sequence */
+				case ESC_START:
+					if (c == '[') {
+						f->esc = ESC_CSI;
+					}
+					else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') {
+						f->esc = ESC_STRING;
+						f->nstr = 0;
+					}
+					else if (c >= 32 && c <= 47) {
+						f->esc = ESC_INTER;
+					}
+					else if (c >= 48 && c <= 126) {
+						f->esc = ESC_NONE;
+					}
+					else {
+						f->esc = ESC_NONE;
+						break;
+					}
+					continue;
+				case ESC_INTER:
+					if (c >= 32 && c <= 47) {
+						continue;
+					}
+					f->esc = ESC_NONE;
+					if (c >= 48 && c <= 126) {
+						continue;
+					}
+					break;
+				case ESC_CSI:
+					if (c >= 32 && c <= 63) {
+						/* parameter and intermediate bytes */
+						continue;
+					}
+					if (c >= 64 && c <= 126) {
+						/* final byte */
+						f->esc = ESC_NONE;
+						continue;
+					}
+					break;
+				case ESC_STRING:
+					if (c == 7) {
+						f->esc = ESC_NONE;
+					}
+					else if (c == 27) {
+						f->esc = ESC_STRESC;
+					}
+					else if (c == '\n' || ++f->nstr > ESC_STRING_MAX) {
+						/* the newline, or the rest, goes through */
+						f->esc = ESC_NONE;
+						break;
+					}
+					continue;
+			}
+			if (c == 27) {
+				f->esc = ESC_START;
+				continue;
+			}
+		}
+
+		o = FLT_NAME(putprio)(f, c, o);
+	}
+
+	return o - out;
+}
+
+#undef FLT_FLAGS
+#undef FLT_NAME
@@ -0,0 +1,181 @@
+/*
+ * fmt.c	A small formatter for the messages and the file names the
+ *		capture core and the logfile sink put together, so they
+ *		can do without stdio (see "make tiny").
+ *
+ *		It knows %s, %c, %d and %u with an l or ll in front, a
+ *		precision on %s (%.24s, %.*s) and %%. No widths, no
+ *		floating point, no locale.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include "bootlogd.h"
+
+/*
+ * The longest message fmt_fd() writes.
+ */
+#define FMT_MAX 1024
+
+/*
+ * Add n bytes at p to buf, as far as they fit; len counts them all.
+ */
+static void put(char *buf, int size, int *len, const char *p, int n)
+{
+	int room = size - 1 - *len;
+
+	if (room > n) {
+		room = n;
+	}
+	if (room > 0) {
+		memcpy(buf + *len, p, room);
+	}
+	*len += n;
+}
+
+static void putnum(char *buf, int size, int *len, unsigned long long v, int neg)
+{
+	char digits[24];
+	int i = sizeof(digits);
+
+	do {
+		digits[--i] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (neg) {
+		digits[--i] = '-';
+	}
+	put(buf, size, len, digits + i, sizeof(digits) - i);
+}
+
+/*
+ * Like vsnprintf(): returns the length the whole thing would have.
+ */
+static int fmt_vbuf(char *buf, int size, const char *fmt, va_list ap)
+{
+	const char *s;
+	long long v;
+	int len = 0, prec, lng, n;
+	char c;
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%') {
+			for (s = fmt; fmt[1] && fmt[1] != '%'; fmt++)
+				;
+			put(buf, size, &len, s, fmt - s + 1);
+			continue;
+		}
+		fmt++;
+		prec = -1;
+		if (*fmt == '.') {
+			fmt++;
+			if (*fmt == '*') {
+				prec = va_arg(ap, int);
+				fmt++;
+			}
+			else {
+				for (prec = 0; *fmt >= '0' && *fmt <= '9'; fmt++) {
+					prec = prec * 10 + *fmt - '0';
+				}
+			}
+		}
+		for (lng = 0; *fmt == 'l'; fmt++) {
+			lng++;
+		}
+		switch (*fmt) {
+			case 's':
+				if ((s = va_arg(ap, const char *)) == NULL) {
+					s = "(null)";
+				}
+				for (n = 0; s[n] && (prec < 0 || n < prec); n++)
+					;
+				put(buf, size, &len, s, n);
+				break;
+			case 'c':
+				c = va_arg(ap, int);
+				put(buf, size, &len, &c, 1);
+				break;
+			case 'd':
+				v = lng > 1 ? va_arg(ap, long long) :
+					lng ? va_arg(ap, long) : va_arg(ap, int);
+				putnum(buf, size, &len, v < 0 ? -(unsigned long long)v : (unsigned long long)v, v < 0);
+				break;
+			case 'u':
+				putnum(buf, size, &len, lng > 1 ? va_arg(ap, unsigned long long) :
+						lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int), 0);
+				break;
+			case 0:
+				fmt--;
+				break;
+			default:
+				put(buf, size, &len, fmt, 1);
+				break;
+		}
+	}
+	if (size > 0) {
+		buf[len < size ? len : size - 1] = 0;
+	}
+
+	return len;
+}
+
+/*
+ * Like snprintf().
+ */
+int fmt_buf(char *buf, int size, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = fmt_vbuf(buf, size, fmt, ap);
+	va_end(ap);
+
+	return n;
+}
+
+/*
+ * Like dprintf(), in one write() and cut at FMT_MAX bytes.
+ */
+void fmt_fd(int fd, const char *fmt, ...)
+{
+	char buf[FMT_MAX];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = fmt_vbuf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n >= (int)sizeof(buf)) {
+		n = sizeof(buf) - 1;
+	}
+	if (write(fd, buf, n) < 0) {
+		/* nowhere left to say so */
+	}
+}
+
+/*
+ * Like strerror(). The small build just gives the number: the
+ * messages would take gettext, and with it the locales, along.
+ */
+const char *fmt_err(int e)
+{
+#ifndef TINY
+	return strerror(e);
+#else
+	static char buf[24];
+
+	fmt_buf(buf, sizeof(buf), "error %d", e);
+
+	return buf;
+#endif
+}
@@ -0,0 +1,602 @@
+/*
+ * forward.c	Streaming lines to a collector (-o name=tcp:host:port).
+ *
+ *		Lines are sent over TCP, UDP or a unix stream socket, in
+ *		frames that carry many lines at a time. Every line has a
+ *		sequence number, and the collector answers with the number
+ *		of the next line it expects; only then does the cursor of the
+ *		sink move, so a line is kept in the ring until the collector
+ *		has it. After a dropped connection (or, with UDP, an ack that
+ *		does not come) we send again from the last acked line, and
+ *		the collector drops what it already has.
+ *
+ *		The numbers are those of the ring records plus a base, so
+ *		lines the ring lost before we got to them show up as a gap.
+ *		The stream id and the numbers handed out so far are kept in
+ *		a file next to the logfile. When bootlogd starts again it
+ *		picks up the same stream with numbers above any it may have
+ *		sent before, so the collector never mistakes new lines for
+ *		old ones.
+ *
+ *		A frame, all numbers big-endian:
+ *
+ *		"BLF1", 4 bytes length of the rest, 8 bytes stream id,
+ *		8 bytes number after the last line of the frame before,
+ *		2 bytes number of lines, 1 byte flags (1 this process
+ *		started the stream here), 1 byte host name length, the name,
+ *		then for each line: 8 bytes sequence number, 8 bytes arrival
+ *		(usecs since the epoch), 1 byte kernel priority (255 for
+ *		none), 1 byte flags (1 line ends here, 2 continues the one
+ *		before), 2 bytes length and the text.
+ *
+ *		The ack: "BLA1", 8 bytes stream id, 8 bytes next number.
+ *		A collector takes a frame only if it follows on from what it
+ *		has (or starts a stream), so a frame lost over UDP is never
+ *		skipped over.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bootlogd.h"
+
+#define FWD_DGRAM	8192	/* largest frame over UDP */
+#define FWD_WINDOW	4096	/* lines sent but not acked */
+#define FWD_POLL	50	/* msecs between looks for acks */
+#define FWD_RESEND	1000	/* msecs without an ack before UDP resends */
+#define FWD_RETRY	1000	/* msecs between connection attempts */
+#define FWD_RESERVE	65536	/* numbers taken at a time, see fwd_save() */
+
+struct fwd {
+	int type;			/* SOCK_STREAM or SOCK_DGRAM */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int connecting;			/* connect() in progress */
+	int loaded;			/* looked for the cursor file */
+
+	unsigned long long stream;	/* stream id */
+	unsigned long long base;	/* sequence number of ring record 0 */
+	unsigned long long start;	/* the first number of this process */
+	unsigned long long acked;	/* next number the collector wants */
+	unsigned long long sent;	/* after the last line sent */
+	unsigned long long reserved;	/* numbers below this may have been sent */
+	unsigned long long saved;	/* ... and below this the file says so */
+	unsigned long long saving;	/* what the child is writing, see fwd_save() */
+	pid_t savepid;
+
+	struct ringcur sendcur;		/* next record to send */
+	long long lastack;		/* mononow() of the last ack, or send */
+
+	unsigned char *obuf;		/* frame being sent */
+	int olen, ooff;
+	unsigned char ibuf[FWD_ACK];		/* ack being read */
+	int ilen;
+	char host[256];
+};
+
+static int fwd_pump(struct sink *s, int idx);
+
+static void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(unsigned char *p, unsigned long v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static void put64(unsigned char *p, unsigned long long v)
+{
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static unsigned long long get64(unsigned char *p)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		v = v << 8 | p[i];
+	}
+
+	return v;
+}
+
+/*
+ * An address, host:port or a unix socket path. Hosts are numeric
+ * addresses (in brackets for IPv6): there is no resolver during early
+ * boot, and a lookup would block the main loop. Also used by the
+ * collector (collect.c).
+ */
+int fwd_addr(char *where, int family, struct sockaddr_storage *addr, socklen_t *len)
+{
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	struct sockaddr_un *sun;
+	char *host, *port, *end;
+	long n;
+
+	memset(addr, 0, sizeof(*addr));
+	if (family == AF_UNIX) {
+		sun = (struct sockaddr_un *)addr;
+		if (*where == 0 || strlen(where) >= sizeof(sun->sun_path)) {
+			fprintf(stderr, "bootlogd: bad socket \"%s\"\n", where);
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, where);
+		*len = sizeof(struct sockaddr_un);
+
+		return 0;
+	}
+
+	host = where;
+	if (*host == '[' && (port = strchr(host, ']')) != NULL && port[1] == ':') {
+		host++;
+		*port++ = 0;
+	}
+	else {
+		port = strrchr(host, ':');
+	}
+	if (port == NULL) {
+		fprintf(stderr, "bootlogd: no port in \"%s\"\n", where);
+		return -1;
+	}
+	*port++ = 0;
+
+	/*
+	 * Numbers only: no resolver, which would want the shared
+	 * libraries of NSS in a static binary, and the network.
+	 */
+	n = strtol(port, &end, 10);
+	sin = (struct sockaddr_in *)addr;
+	sin6 = (struct sockaddr_in6 *)addr;
+	if (end == port || *end || n < 0 || n > 65535) {
+		fprintf(stderr, "bootlogd: bad address \"%s:%s\"\n", host, port);
+		return -1;
+	}
+	if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(n);
+		*len = sizeof(struct sockaddr_in);
+	}
+	else if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(n);
+		*len = sizeof(struct sockaddr_in6);
+	}
+	else {
+		fprintf(stderr, "bootlogd: bad address \"%s:%s\"\n", host, port);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int fwd_setup(struct sink *s, char *where, int family, int type)
+{
+	struct fwd *f;
+
+	if ((f = calloc(1, sizeof(struct fwd))) == NULL ||
+			(f->obuf = malloc(FWD_FRAME)) == NULL) {
+		fprintf(stderr, "bootlogd: %s: out of memory\n", s->name);
+		return -1;
+	}
+	f->type = type;
+	f->savepid = -1;
+	if (fwd_addr(where, family, &f->addr, &f->addrlen) < 0) {
+		return -1;
+	}
+
+	s->path = where;
+	s->pump = fwd_pump;
+	s->fwd = f;
+
+	return 0;
+}
+
+int fwd_tcp(struct sink *s, char *where)
+{
+	return fwd_setup(s, where, AF_INET, SOCK_STREAM);
+}
+
+int fwd_udp(struct sink *s, char *where)
+{
+	return fwd_setup(s, where, AF_INET, SOCK_DGRAM);
+}
+
+int fwd_unix(struct sink *s, char *where)
+{
+	return fwd_setup(s, where, AF_UNIX, SOCK_STREAM);
+}
+
+/*
+ * The cursor file: "logfile.name.cursor".
+ */
+static void fwd_cursorfile(struct sink *s, char *path, int size)
+{
+	snprintf(path, size, "%s.%s.cursor", sinks[0].path, s->name);
+}
+
+/*
+ * Write the stream id and the numbers below reserved to the cursor
+ * file (the acked number goes along, but only for whoever reads the
+ * file). Returns -1 if any of it failed.
+ */
+static int fwd_write(struct sink *s, unsigned long long reserved)
+{
+	struct fwd *f = s->fwd;
+	char path[1024], tmp[1032];
+	FILE *fp;
+	int bad;
+
+	fwd_cursorfile(s, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s~", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		return -1;
+	}
+	bad = fprintf(fp, "%016llx %llu %llu\n", f->stream, f->acked, reserved) < 0;
+	bad |= fflush(fp) != 0 || fdatasync(fileno(fp)) < 0;
+	bad |= fclose(fp) != 0;
+	if (bad || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Make sure the file has the numbers below f->reserved. Taking them
+ * FWD_RESERVE at a time means we write the file once in that many
+ * lines, and still never hand out a number twice: nothing from a new
+ * reservation is sent before the file with it is on disk. With -R,
+ * a child at normal priority does the writing, so the capture never
+ * waits for the disk. Returns 0 once the file has them, 1 while the
+ * child is at it, -1 if it could not be written (try again later).
+ */
+static int fwd_save(struct sink *s)
+{
+	struct fwd *f = s->fwd;
+	int status;
+	pid_t pid;
+
+	if (f->savepid > 0) {
+		if ((pid = waitpid(f->savepid, &status, WNOHANG)) == 0) {
+			return 1;
+		}
+		f->savepid = -1;
+		if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			f->saved = f->saving;
+		}
+		else {
+			return -1;
+		}
+	}
+	if (f->saved >= f->reserved) {
+		return 0;
+	}
+	f->saving = f->reserved;
+	if (rtprio && (pid = fork()) >= 0) {
+		if (pid == 0) {
+			rt_undo();
+			_exit(fwd_write(s, f->saving) < 0);
+		}
+		f->savepid = pid;
+		return 1;
+	}
+	if (fwd_write(s, f->saving) < 0) {
+		return -1;
+	}
+	f->saved = f->saving;
+
+	return 0;
+}
+
+static void fwd_load(struct sink *s)
+{
+	struct fwd *f = s->fwd;
+	char path[1024];
+	FILE *fp;
+	int fd;
+
+	f->loaded = 1;
+	fwd_cursorfile(s, path, sizeof(path));
+	if ((fp = fopen(path, "r")) != NULL) {
+		if (fscanf(fp, "%llx %llu %llu", &f->stream, &f->acked, &f->reserved) != 3) {
+			f->stream = 0;
+		}
+		fclose(fp);
+	}
+	if (f->stream == 0) {
+		if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+			if (read(fd, &f->stream, sizeof(f->stream)) < 0) {
+				f->stream = 0;
+			}
+			close(fd);
+		}
+		f->stream ^= (unsigned long long)getpid() << 32 ^ mononow();
+		f->acked = f->reserved = 0;
+	}
+
+	/*
+	 * Start above anything sent before; lines we had sent but not
+	 * got acked went with the old process.
+	 */
+	f->saved = f->base = f->reserved;
+	f->start = f->acked = f->sent = f->base + s->cur.seq;
+	f->reserved = f->acked + FWD_RESERVE;
+}
+
+static void fwd_disconnect(struct sink *s)
+{
+	struct fwd *f = s->fwd;
+
+	close(s->fd);
+	s->fd = -1;
+	f->connecting = 0;
+	f->olen = f->ooff = f->ilen = 0;
+}
+
+static int fwd_connect(struct sink *s)
+{
+	struct fwd *f = s->fwd;
+	long long now = mononow();
+
+	if (now < s->retry) {
+		return -1;
+	}
+	s->retry = now + FWD_RETRY;
+
+	if ((s->fd = socket(f->addr.ss_family, f->type|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0) {
+		return -1;
+	}
+	if (connect(s->fd, (struct sockaddr *)&f->addr, f->addrlen) < 0) {
+		if (errno != EINPROGRESS) {
+			fwd_disconnect(s);
+			return -1;
+		}
+		f->connecting = 1;
+	}
+	if (gethostname(f->host, sizeof(f->host)) < 0) {
+		f->host[0] = 0;
+	}
+	f->host[sizeof(f->host) - 1] = 0;
+
+	/* send again whatever was not acked */
+	f->sendcur = s->cur;
+	f->sent = f->acked;
+	f->lastack = now;
+
+	return 0;
+}
+
+/*
+ * Has a connect() in progress gone through? -1 if it failed.
+ */
+static int fwd_connected(struct sink *s)
+{
+	struct pollfd pfd;
+	socklen_t len;
+	int err;
+
+	pfd.fd = s->fd;
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, 0) <= 0) {
+		return 0;
+	}
+	len = sizeof(err);
+	if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+		return -1;
+	}
+	s->fwd->connecting = 0;
+
+	return 1;
+}
+
+/*
+ * Take in the acks, and move the cursor past what the collector has.
+ */
+static int fwd_acks(struct sink *s, int idx)
+{
+	struct fwd *f = s->fwd;
+	struct logrec *rec;
+	unsigned long long next;
+	int n;
+
+	for (;;) {
+		if ((n = recv(s->fd, f->ibuf + f->ilen, sizeof(f->ibuf) - f->ilen, 0)) < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				break;
+			}
+			return -1;
+		}
+		if (n == 0 && f->type == SOCK_STREAM) {
+			return -1;
+		}
+		f->ilen += n;
+		if (f->ilen < (int)sizeof(f->ibuf) && f->type == SOCK_STREAM) {
+			continue;
+		}
+		n = f->ilen;
+		f->ilen = 0;
+		if (n != sizeof(f->ibuf) || memcmp(f->ibuf, "BLA1", 4) != 0) {
+			if (f->type == SOCK_STREAM) {
+				return -1;
+			}
+			continue;
+		}
+		next = get64(f->ibuf + 12);
+		if (next > f->sent) {
+			/* we never sent that far */
+			next = f->sent;
+		}
+		if (get64(f->ibuf + 4) != f->stream || next <= f->acked) {
+			continue;
+		}
+		while (s->cur.pos < f->sendcur.pos && (rec = ring_next(&s->cur)) != NULL &&
+				(f->base + rec->seq < next || !(rec->route & (1U << idx)))) {
+			if (rec->route & (1U << idx)) {
+				s->lines++;
+			}
+			ring_advance(&s->cur, rec);
+		}
+		f->acked = next;
+		f->lastack = mononow();
+	}
+
+	return 0;
+}
+
+/*
+ * Put the next lines into a frame. Returns the number of lines.
+ */
+static int fwd_frame(struct sink *s, int idx)
+{
+	struct fwd *f = s->fwd;
+	struct logrec *rec;
+	unsigned char *p;
+	unsigned long long seq, last = 0;
+	int max, hlen, n = 0;
+
+	max = f->type == SOCK_DGRAM ? FWD_DGRAM : FWD_FRAME;
+	hlen = strlen(f->host);
+	p = f->obuf + FWD_HDR + hlen;
+	while ((rec = ring_next(&f->sendcur)) != NULL) {
+		seq = f->base + rec->seq;
+		if (seq >= f->acked + FWD_WINDOW || n == 65535) {
+			break;
+		}
+		if (rec->route & (1U << idx)) {
+			if (p + FWD_LINE + rec->len > f->obuf + max) {
+				break;
+			}
+			if (seq >= f->saved) {
+				/* not ours until the file says so, see fwd_save() */
+				if (seq >= f->reserved) {
+					f->reserved = seq + FWD_RESERVE;
+				}
+				break;
+			}
+			put64(p, seq);
+			put64(p + 8, (unsigned long long)rec->time.tv_sec * 1000000 +
+					rec->time.tv_nsec / 1000);
+			p[16] = rec->prio >= 0 ? rec->prio : 255;
+			p[17] = (rec->flags & REC_NL ? 1 : 0) | (rec->flags & REC_CONT ? 2 : 0);
+			put16(p + 18, rec->len);
+			memcpy(p + FWD_LINE, REC_TEXT(rec), rec->len);
+			p += FWD_LINE + rec->len;
+			last = seq;
+			n++;
+		}
+		ring_advance(&f->sendcur, rec);
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	memcpy(f->obuf, "BLF1", 4);
+	put32(f->obuf + 4, p - f->obuf - 8);
+	put64(f->obuf + 8, f->stream);
+	put64(f->obuf + 16, f->sent);
+	put16(f->obuf + 24, n);
+	f->obuf[26] = f->sent == f->start;
+	f->obuf[27] = hlen;
+	memcpy(f->obuf + FWD_HDR, f->host, hlen);
+	f->sent = last + 1;
+	f->olen = p - f->obuf;
+	f->ooff = 0;
+
+	return n;
+}
+
+/*
+ * Send what we can, and see what the collector got.
+ */
+static int fwd_pump(struct sink *s, int idx)
+{
+	struct fwd *f = s->fwd;
+	struct ringcur cur;
+	long long now;
+	int n, held = 0;
+
+	if (!f->loaded) {
+		fwd_load(s);
+	}
+	s->flushpending = 1;
+	if (s->fd < 0 && fwd_connect(s) < 0) {
+		cur = s->cur;
+		s->flushpending = ring_next(&cur) != NULL;
+		return 0;
+	}
+	now = mononow();
+	if (f->connecting && (n = fwd_connected(s)) <= 0) {
+		if (n < 0 || now - f->lastack >= FWD_RETRY) {
+			fwd_disconnect(s);
+		}
+		s->retry = now + FWD_POLL;
+		return 0;
+	}
+	if (fwd_acks(s, idx) < 0) {
+		fwd_disconnect(s);
+		return 0;
+	}
+
+	/* over UDP, a frame or its ack may have been lost */
+	if (f->type == SOCK_DGRAM && f->sent > f->acked && now - f->lastack >= FWD_RESEND) {
+		f->sendcur = s->cur;
+		f->sent = f->acked;
+		f->olen = f->ooff = 0;
+		f->lastack = now;
+	}
+
+	for (;;) {
+		if (f->ooff == f->olen && fwd_frame(s, idx) == 0) {
+			/* the next numbers have to be taken first */
+			if (f->saved >= f->reserved || (held = fwd_save(s)) != 0) {
+				break;
+			}
+			continue;
+		}
+		if ((n = send(s->fd, f->obuf + f->ooff, f->olen - f->ooff, MSG_NOSIGNAL)) < 0) {
+			if (errno == EAGAIN || errno == EINTR || errno == ENOBUFS) {
+				break;
+			}
+			fwd_disconnect(s);
+			return 0;
+		}
+		f->ooff = f->type == SOCK_DGRAM ? f->olen : f->ooff + n;
+	}
+
+	/* done once everything is acked, else come back for the acks */
+	if (f->sent <= f->acked && f->ooff == f->olen) {
+		s->cur = f->sendcur;
+		cur = s->cur;
+		s->flushpending = ring_next(&cur) != NULL;
+	}
+	s->retry = now + (held < 0 ? FWD_RETRY : FWD_POLL);
+
+	return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * journal.c	Forwarding lines to the systemd journal (-o name=journal).
+ *
+ *		Uses the native protocol of journald: an entry is a list of
+ *		FIELD=value lines, entries are separated by an empty line,
+ *		and many of them can go in one datagram. Each line becomes
+ *		an entry with MESSAGE, PRIORITY (from the kernel prefix),
+ *		SYSLOG_IDENTIFIER and BOOTLOGD_REALTIME_USEC, the time the
+ *		line came in, which journald would not know otherwise.
+ *
+ *		Until journald is up, lines wait in the ring. By then there
+ *		is usually a big backlog; what does not fit in a datagram
+ *		is written to a memfd which is sealed and passed to journald
+ *		with SCM_RIGHTS, so the whole backlog goes in one message.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bootlogd.h"
+
+#define JRN_PATH	"/run/systemd/journal/socket"
+#define JRN_DGRAM	(48 * 1024)		/* most we put in a datagram */
+#define JRN_MAX		(16 * 1024 * 1024)	/* most we put in a memfd */
+#define JRN_ENTRY	(LOGLINE_MAX + 256)	/* room for one entry */
+#define JRN_RETRY	1000	/* msecs between connection attempts */
+#define JRN_BACKOFF	20	/* msecs to wait when the socket is full */
+
+static char jbuf[JRN_DGRAM + JRN_ENTRY];
+
+int journal_setup(struct sink *s, char *path)
+{
+	s->path = *path ? path : JRN_PATH;
+	s->pump = journal_pump;
+	s->tag = "bootlogd";
+
+	return 0;
+}
+
+static int journal_connect(struct sink *s)
+{
+	struct sockaddr_un sun;
+	long long now = mononow();
+
+	if (now < s->retry) {
+		return -1;
+	}
+	s->retry = now + JRN_RETRY;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, s->path, sizeof(sun.sun_path) - 1);
+	if ((s->fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0)) < 0) {
+		return -1;
+	}
+	if (connect(s->fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(s->fd);
+		s->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * One entry, at p, in the room left in jbuf. Returns its length, or
+ * -1 if it does not fit.
+ */
+static int journal_entry(struct sink *s, struct logrec *rec, char *p)
+{
+	unsigned long long len;
+	char *text = REC_TEXT(rec);
+	char *start = p;
+	int i, n = rec->len;
+	int room = jbuf + sizeof(jbuf) - p;
+	int hdr;
+
+	if (rec->prio >= 0 && !(rec->flags & REC_CONT) && n >= 3) {
+		text += 3;
+		n -= 3;
+	}
+	hdr = snprintf(p, room, "PRIORITY=%d\nSYSLOG_IDENTIFIER=%s\nBOOTLOGD_REALTIME_USEC=%llu\n",
+			rec->prio >= 0 ? rec->prio : 6, s->tag,
+			(unsigned long long)rec->time.tv_sec * 1000000 + rec->time.tv_nsec / 1000);
+	/* the message, in the longer of its two forms, and the blank line */
+	if (hdr < 0 || hdr + 16 + n + 2 > room) {
+		return -1;
+	}
+	p += hdr;
+	if (memchr(text, '\n', n) == NULL) {
+		memcpy(p, "MESSAGE=", 8);
+		memcpy(p + 8, text, n);
+		p += 8 + n;
+	}
+	else {
+		/* the binary form: name, newline, 64 bit little endian length */
+		memcpy(p, "MESSAGE\n", 8);
+		p += 8;
+		for (len = n, i = 0; i < 8; i++, len >>= 8) {
+			*p++ = len & 0xff;
+		}
+		memcpy(p, text, n);
+		p += n;
+	}
+	*p++ = '\n';
+	*p++ = '\n';
+
+	return p - start;
+}
+
+/*
+ * Fill jbuf with the entries the sink wants, up to about JRN_DGRAM
+ * bytes. Returns the length; *nrec counts the entries.
+ * A line that would not fit even in an empty jbuf (it cannot, with
+ * the tag bounded) is counted as lost rather than tried forever.
+ */
+static int journal_fill(struct sink *s, int idx, struct ringcur *cur, int *nrec)
+{
+	struct logrec *rec;
+	int len = 0, n;
+
+	while (len < JRN_DGRAM && (rec = ring_next(cur)) != NULL) {
+		if (rec->route & (1U << idx)) {
+			if ((n = journal_entry(s, rec, jbuf + len)) < 0) {
+				if (len > 0) {
+					break;
+				}
+				cur->lost++;
+			}
+			else {
+				len += n;
+				(*nrec)++;
+			}
+		}
+		ring_advance(cur, rec);
+	}
+
+	return len;
+}
+
+/*
+ * Pass what we have, and what is left, to journald in a sealed memfd.
+ * Returns the number of records in it, or -1.
+ */
+static int journal_memfd(struct sink *s, int idx, struct ringcur *cur, int len, int nrec)
+{
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	long total = 0;
+	int fd;
+
+	if ((fd = memfd_create("bootlogd-journal", MFD_CLOEXEC|MFD_ALLOW_SEALING)) < 0) {
+		return -1;
+	}
+	for (;;) {
+		if (write(fd, jbuf, len) != len) {
+			close(fd);
+			return -1;
+		}
+		total += len;
+		if (total + (long)sizeof(jbuf) > JRN_MAX) {
+			break;
+		}
+		len = journal_fill(s, idx, cur, &nrec);
+		if (len == 0) {
+			break;
+		}
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+	memset(&control, 0, sizeof(control));
+	mh.msg_control = &control;
+	mh.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	if (sendmsg(s->fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL) < 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	return nrec;
+}
+
+/*
+ * Send what the sink has not seen yet.
+ */
+int journal_pump(struct sink *s, int idx)
+{
+	struct ringcur cur;
+	int len, n;
+
+	s->flushpending = 1;
+	if (s->fd < 0 && journal_connect(s) < 0) {
+		cur = s->cur;
+		s->flushpending = ring_next(&cur) != NULL;
+		return 0;
+	}
+
+	for (;;) {
+		cur = s->cur;
+		n = 0;
+		len = journal_fill(s, idx, &cur, &n);
+		if (n == 0) {
+			s->cur = cur;
+			s->flushpending = 0;
+			return 0;
+		}
+
+		if (len >= JRN_DGRAM && ring_next(&cur) != NULL) {
+			n = journal_memfd(s, idx, &cur, len, n);
+		}
+		else if (send(s->fd, jbuf, len, MSG_DONTWAIT|MSG_NOSIGNAL) < 0) {
+			n = -1;
+		}
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR || errno == ENOBUFS) {
+				s->retry = mononow() + JRN_BACKOFF;
+			}
+			else {
+				/* journald went away, or is not quite there yet */
+				close(s->fd);
+				s->fd = -1;
+			}
+			return 0;
+		}
+		s->cur = cur;
+		s->lines += n;
+	}
+}
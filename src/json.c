@@ -0,0 +1,216 @@
+/*
+ * json.c	JSON Lines output (-o name=file,json).
+ *
+ *		One object per record:
+ *
+ *		{"realtime_usec":N,"boottime_usec":N,"seq":N,
+ *		 "source":"console","priority":N,"message":"..."}
+ *
+ *		with "priority" null if the line had no kernel prefix (which
+ *		is left out of the message), and "partial":true or
+ *		"continued":true for the pieces of a line too long, or too
+ *		slow, to be kept together.
+ *
+ *		The object is put together in a static buffer and written
+ *		with one fwrite(), numbers are formatted by hand, and the
+ *		message is escaped a word at a time: a word with nothing to
+ *		escape in it (no control character, quote or backslash) and
+ *		nothing from 0x80 up is copied as it is, which is nearly all
+ *		of them. The rest goes a byte at a time, or for valid UTF-8
+ *		a character at a time; a byte that is not part of valid
+ *		UTF-8 becomes U+FFFD, so the output is always valid JSON.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "bootlogd.h"
+
+#define ONES	(~0UL / 255)		/* 0x0101...01 */
+#define HIGHS	(ONES * 0x80)		/* 0x8080...80 */
+
+/*
+ * A byte of w below n (n at most 128), or equal to zero.
+ */
+#define HASLESS(w, n)	(((w) - ONES * (n)) & ~(w) & HIGHS)
+#define HASZERO(w)	HASLESS(w, 1)
+
+static char hex[] = "0123456789abcdef";
+
+static char *putstr(char *p, const char *s)
+{
+	while (*s) {
+		*p++ = *s++;
+	}
+
+	return p;
+}
+
+static char *putnum(char *p, unsigned long long n)
+{
+	char tmp[24];
+	int i = 0;
+
+	do {
+		tmp[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	while (i > 0) {
+		*p++ = tmp[--i];
+	}
+
+	return p;
+}
+
+/*
+ * The length of the valid UTF-8 character at s, 0 if it is not one
+ * (a stray continuation byte, an overlong form, a surrogate, beyond
+ * U+10FFFF, or cut short by end).
+ */
+static int utf8len(const unsigned char *s, const unsigned char *end)
+{
+	unsigned long cp;
+	int n, i;
+
+	if (*s < 0xc2) {
+		return 0;
+	}
+	else if (*s < 0xe0) {
+		n = 2;
+		cp = *s & 0x1f;
+	}
+	else if (*s < 0xf0) {
+		n = 3;
+		cp = *s & 0x0f;
+	}
+	else if (*s < 0xf5) {
+		n = 4;
+		cp = *s & 0x07;
+	}
+	else {
+		return 0;
+	}
+	if (end - s < n) {
+		return 0;
+	}
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+		cp = cp << 6 | (s[i] & 0x3f);
+	}
+	if ((n == 3 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) ||
+			(n == 4 && (cp < 0x10000 || cp > 0x10ffff))) {
+		return 0;
+	}
+
+	return n;
+}
+
+/*
+ * Escape len bytes of s into p, which has room for 6 times as many.
+ */
+static char *escape(char *p, const unsigned char *s, int len)
+{
+	const unsigned char *end = s + len;
+	unsigned long w;
+	int c, n;
+
+	while (s < end) {
+		if (end - s >= (int)sizeof(w)) {
+			memcpy(&w, s, sizeof(w));
+			if (!(w & HIGHS) && !HASLESS(w, 0x20) && !HASZERO(w ^ (ONES * '"')) &&
+					!HASZERO(w ^ (ONES * '\\'))) {
+				memcpy(p, s, sizeof(w));
+				p += sizeof(w);
+				s += sizeof(w);
+				continue;
+			}
+		}
+		if (*s >= 0x80) {
+			if ((n = utf8len(s, end)) > 0) {
+				memcpy(p, s, n);
+				p += n;
+				s += n;
+			}
+			else {
+				p = putstr(p, "\\ufffd");
+				s++;
+			}
+			continue;
+		}
+		c = *s++;
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			*p++ = c;
+			continue;
+		}
+		*p++ = '\\';
+		switch (c) {
+			case '"':
+			case '\\':
+				*p++ = c;
+				break;
+			case '\n':
+				*p++ = 'n';
+				break;
+			case '\r':
+				*p++ = 'r';
+				break;
+			case '\t':
+				*p++ = 't';
+				break;
+			default:
+				p = putstr(p, "u00");
+				*p++ = hex[c >> 4];
+				*p++ = hex[c & 15];
+				break;
+		}
+	}
+
+	return p;
+}
+
+void json_write(struct sink *s, struct logrec *rec)
+{
+	static char buf[LOGLINE_MAX * 6 + 256];
+	unsigned char *text = (unsigned char *)REC_TEXT(rec);
+	int len = rec->len;
+	char *p = buf;
+
+	p = putstr(p, "{\"realtime_usec\":");
+	p = putnum(p, (unsigned long long)rec->time.tv_sec * 1000000 + rec->time.tv_nsec / 1000);
+	p = putstr(p, ",\"boottime_usec\":");
+	p = putnum(p, rec->boot);
+	p = putstr(p, ",\"seq\":");
+	p = putnum(p, rec->seq);
+	p = putstr(p, ",\"source\":\"console\",\"priority\":");
+	if (rec->prio >= 0) {
+		*p++ = '0' + rec->prio;
+		if (!(rec->flags & REC_CONT) && len >= 3) {
+			text += 3;
+			len -= 3;
+		}
+	}
+	else {
+		p = putstr(p, "null");
+	}
+	if (rec->flags & REC_CONT) {
+		p = putstr(p, ",\"continued\":true");
+	}
+	if (!(rec->flags & REC_NL)) {
+		p = putstr(p, ",\"partial\":true");
+	}
+	p = putstr(p, ",\"message\":\"");
+	p = escape(p, text, len);
+	p = putstr(p, "\"}\n");
+
+	fwrite(buf, 1, p - buf, s->fp);
+	s->lines++;
+}
@@ -0,0 +1,217 @@
+/*
+ * latency.c	What the detour through bootlogd costs (-k).
+ *
+ *		Kernel messages go straight to the console drivers; the
+ *		TIOCCONS redirection only catches what user space writes to
+ *		/dev/console. So we measure what can be measured:
+ *
+ *		- kmsg: from the kernel time stamp of a record in /dev/kmsg
+ *		  to when we read it. This is what any reader of kernel
+ *		  messages sees, and the baseline for the rest.
+ *		- pty: from the kernel time stamp of a record to the same
+ *		  text coming in on the pty, for programs that log to both
+ *		  (systemd with LogTarget=kmsg, for one).
+ *		- console: from reading the pty to the real console taking
+ *		  the data, per console.
+ *
+ *		Each goes into a histogram with power of two buckets, in
+ *		microseconds. The kernel stamps records with its own clock,
+ *		which runs with CLOCK_MONOTONIC closely enough for this.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bootlogd.h"
+
+#define LAT_BUCKETS	24	/* 1 us up to 8 s and more */
+#define LAT_RECENT	256	/* kmsg records we try to match */
+
+struct hist {
+	const char *name;
+	unsigned long count[LAT_BUCKETS];
+	unsigned long n;
+	long long max;
+};
+
+static struct hist hists[] = {
+	{ "kmsg_to_read",       { 0 }, 0, 0 },
+	{ "printk_to_pty",      { 0 }, 0, 0 },
+	{ "capture_to_console", { 0 }, 0, 0 },
+};
+#define H_KMSG		0
+#define H_PTY		1
+#define H_CONSOLE	2
+#define NHISTS		3
+
+/*
+ * Recent kmsg records, by a hash of their text.
+ */
+static struct {
+	unsigned long hash;
+	long long usec;
+} recent[LAT_RECENT];
+static int nrecent = 0;
+
+int lat_fd = -1;
+
+static void lat_add(int h, long long us)
+{
+	int b = 0;
+
+	if (us < 0) {
+		us = 0;
+	}
+	while (b < LAT_BUCKETS - 1 && (1LL << b) <= us) {
+		b++;
+	}
+	hists[h].count[b]++;
+	hists[h].n++;
+	if (us > hists[h].max) {
+		hists[h].max = us;
+	}
+}
+
+static unsigned long lat_hash(const char *s, int len)
+{
+	unsigned long h = 5381;
+
+	while (len-- > 0) {
+		h = h * 33 + (unsigned char)*s++;
+	}
+
+	return h;
+}
+
+/*
+ * Start reading /dev/kmsg, from now on.
+ */
+int lat_open(void)
+{
+	if ((lat_fd = open("/dev/kmsg", O_RDONLY|O_NONBLOCK)) < 0) {
+		fprintf(stderr, "bootlogd: /dev/kmsg: %s\n", strerror(errno));
+		return -1;
+	}
+	lseek(lat_fd, 0, SEEK_END);
+
+	return lat_fd;
+}
+
+/*
+ * Read what the kernel logged, one record per read:
+ * "prio,seq,usecs,flags;text\n" and maybe more lines of metadata.
+ */
+void lat_read(long long nowus)
+{
+	char buf[2048];
+	char *p, *text;
+	long long usec;
+	int n;
+
+	for (;;) {
+		if ((n = read(lat_fd, buf, sizeof(buf) - 1)) < 0) {
+			if (errno == EPIPE) {
+				/* records we had not read got overwritten */
+				continue;
+			}
+			return;
+		}
+		if (n == 0) {
+			return;
+		}
+		buf[n] = 0;
+		if ((p = strchr(buf, ',')) == NULL || (p = strchr(p + 1, ',')) == NULL ||
+				(text = strchr(p, ';')) == NULL) {
+			continue;
+		}
+		usec = strtoll(p + 1, NULL, 10);
+		text++;
+		if ((p = strchr(text, '\n')) != NULL) {
+			*p = 0;
+		}
+		lat_add(H_KMSG, nowus - usec);
+		recent[nrecent % LAT_RECENT].hash = lat_hash(text, strlen(text));
+		recent[nrecent % LAT_RECENT].usec = usec;
+		nrecent++;
+	}
+}
+
+/*
+ * A line came in on the pty at nowus. Was it logged to kmsg as well?
+ */
+void lat_line(const char *s, int len, long long nowus)
+{
+	unsigned long h;
+	int i, n;
+
+	if (lat_fd < 0) {
+		return;
+	}
+	if (len >= 3 && s[0] == '<' && s[2] == '>') {
+		s += 3;
+		len -= 3;
+	}
+	h = lat_hash(s, len);
+	n = nrecent < LAT_RECENT ? nrecent : LAT_RECENT;
+	for (i = 1; i <= n; i++) {
+		if (recent[(nrecent - i) % LAT_RECENT].hash == h) {
+			lat_add(H_PTY, nowus - recent[(nrecent - i) % LAT_RECENT].usec);
+			return;
+		}
+	}
+}
+
+/*
+ * A console took what we read us microseconds ago.
+ */
+void lat_console(long long us)
+{
+	if (lat_fd >= 0) {
+		lat_add(H_CONSOLE, us);
+	}
+}
+
+void lat_report(const char *file)
+{
+	FILE *fp;
+	int h, b, lo, hi;
+
+	if (file == NULL || lat_fd < 0 || (fp = fopen(file, "w")) == NULL) {
+		return;
+	}
+	for (h = 0; h < NHISTS; h++) {
+		fprintf(fp, "%s count %lu max_us %lld\n", hists[h].name, hists[h].n, hists[h].max);
+		for (lo = 0; lo < LAT_BUCKETS && hists[h].count[lo] == 0; lo++)
+			;
+		for (hi = LAT_BUCKETS - 1; hi >= lo && hists[h].count[hi] == 0; hi--)
+			;
+		for (b = lo; b <= hi; b++) {
+			if (b == LAT_BUCKETS - 1) {
+				fprintf(fp, "  >= %lld us %lu\n", 1LL << (b - 1), hists[h].count[b]);
+			}
+			else {
+				fprintf(fp, "  < %lld us %lu\n", 1LL << b, hists[h].count[b]);
+			}
+		}
+	}
+	fclose(fp);
+}
+
+void lat_close(void)
+{
+	if (lat_fd >= 0) {
+		close(lat_fd);
+		lat_fd = -1;
+	}
+}
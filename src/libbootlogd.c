@@ -0,0 +1,1292 @@
+/*
+ * libbootlogd.c	The capture core: find the consoles, grab a pty and
+ *		take over the console, then copy what comes in on the pty
+ *		to the real consoles and, line by line, to the ring and
+ *		the sinks. bootlogd.c drives it from its own loop, an
+ *		init system can drive it from its own (see libbootlogd.h).
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <poll.h>
+#include <sys/mount.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include "bootlogd.h"
+#include "libbootlogd.h"
+
+#define LOGFILE "/run/log/stage-1.log"
+
+/*
+ * Where the log goes at exit if LOGFILE never showed up.
+ * /dev is there from the very start.
+ */
+#define FALLBACK "/dev/.bootlogd.log"
+
+/*
+ * Where SIGUSR2 puts a snapshot of the ring.
+ */
+#define SNAPSHOT "/dev/.bootlogd.snapshot"
+
+/*
+ * When draining at exit, how long the pty must be quiet (msecs).
+ */
+#define DRAIN_QUIET 20
+
+/*
+ * The number of kernel parameters is not limited, but the length of the
+ * complete command line (parameters including spaces etc.) is limited to a
+ * fixed number of characters. This limit depends on the architecture and is
+ * between 256 and 4096 characters. It is defined in the file
+ * ./include/asm/setup.h as COMMAND_LINE_SIZE.
+ */
+#define KERNEL_COMMAND_LENGTH 4096
+
+/*
+ * Lines with a kernel priority prefix of this level or more severe
+ * (<0> emerg ... <3> err) are urgent.
+ */
+#define URGENT_PRIO 3
+
+
+static char readbuf[65536];
+static unsigned char consbuf[sizeof(readbuf) + FILTER_SLACK];
+
+/*
+ * Set by the signal handlers of whoever runs us.
+ */
+int got_signal = 0;
+int got_usr1 = 0;
+int got_usr2 = 0;
+
+char *statsfile = NULL;		/* -S */
+static char *ctlfile = NULL;		/* -f */
+static struct sink *logsink;	/* -l, the first of the sinks */
+static int ptm = -1, pts = -1;
+static int consoles_left;
+const char *detaching = NULL;
+static int idlewait = 0;		/* detach after this many secs of silence (-i) */
+static char *timeline = NULL;		/* boot timeline report (-B) */
+static char *unitsfile = NULL;		/* unit start times (-U) */
+static char *tpldir = NULL;		/* per-boot template summaries (-M) */
+static int tplkeep = 5;		/* how many of them we keep (-K) */
+static char *latfile = NULL;		/* latency histograms (-k) */
+static char *snapfile = SNAPSHOT;	/* ring snapshot on SIGUSR2 (-z) */
+static long long readus;		/* monousec() of the last read, for -k */
+int createlogfile = 0;
+static int syncalot = 0;
+static unsigned long bytes_read = 0;
+
+/*
+ * The line being assembled.
+ */
+static char linebuf[LOGLINE_MAX];
+static int linelen = 0;
+static int linecont = 0;	/* part of this line was handed on already */
+static struct timespec linetime; /* when the line started */
+static long long lineboot;	/* the same, CLOCK_BOOTTIME usecs, for JSON outputs */
+static long long linemono;	/* the same, mononow(), for -B, -U and -M */
+static int lineprio = -1;	/* kernel priority of the line, -1 if none */
+static unsigned int lineroute;	/* sinks the line goes to */
+
+/*
+ * Batching of logfile writes: bulk lines sit in the logfile buffer for
+ * up to batchwin milliseconds, urgent lines are flushed and synced
+ * right away (taking the bulk lines before them along).
+ */
+int batchwin = 0;
+static unsigned long urgent_lines = 0;
+static long long lastinput = 0;
+
+/*
+ * Read coalescing: under a flood, wait up to readwait microseconds
+ * for more output before handing a small read on (-L). GATHER_MIN is
+ * what we consider a batch worth handing on right away.
+ */
+#define GATHER_MIN	4096
+static int readwait = 0;
+static long long lastread = 0;		/* monousec() of the last read */
+static unsigned long capture_calls = 0; /* select() and read() on the pty */
+static unsigned long gathered = 0;	/* reads that waited for more */
+
+struct real_cons cons[MAX_CONSOLES];
+int num_consoles;
+
+/*
+ * Draining at exit: we keep reading until the pty is quiet, for at
+ * most drainwait msecs. Lines no logfile could take (because it never
+ * showed up) are written to the fallback file.
+ */
+static int drainwait = 2000;		/* -D */
+static char *fallback = FALLBACK;	/* -F */
+static unsigned long drain_bytes = 0;
+static long long drain_ms = 0;
+static unsigned long fallback_lines = 0;
+
+/*
+ * Real-time capture (-R, -m, -C).
+ */
+int rtprio = 0;			/* SCHED_FIFO priority, 0 for none */
+static int lockmem = 0;		/* mlockall() */
+static int pinned = 0;			/* cpus holds our CPUs */
+static cpu_set_t cpus;
+
+/*
+ * The log filter: strip escape sequences and carriage returns.
+ */
+static struct filter logfilter;
+
+/*
+ * Console devices as listed on the kernel command line and
+ * the mapping to actual devices in /dev
+ */
+static struct consdev {
+	char *cmdline;
+	char *dev1;
+	char *dev2;
+} consdev[] = {
+	{ "ttyB",  "/dev/ttyB%s",  NULL  },
+	{ "ttySC", "/dev/ttySC%s", "/dev/ttsc/%s" },
+	{ "ttyS",  "/dev/ttyS%s",  "/dev/tts/%s" },
+	{ "tty",   "/dev/tty%s",   "/dev/vc/%s" },
+	{ "hvc",   "/dev/hvc%s",   "/dev/hvc/%s" },
+	{ NULL,    NULL,           NULL  },
+};
+
+/*
+ * Devices to try as console if not found on kernel command line.
+ * Tried from left to right (as opposed to kernel cmdline).
+ */
+static char *defcons[] = { "tty0", "hvc0", "ttyS0", "ttySC0", "ttyB0", NULL };
+
+/*
+ * For some reason, openpty() in glibc sometimes doesn't
+ * work at boot-time. It must be a bug with old-style pty
+ * names, as new-style (/dev/pts) is not available at that
+ * point. So, we find a pty/tty pair ourself if openpty()
+ * fails for whatever reason.
+ */
+static int findpty(int *master, int *slave, char *name)
+{
+	char pty[16];
+	char tty[16];
+	int i, j;
+	int found;
+
+	if (openpty(master, slave, name, NULL, NULL) >= 0) {
+		return 0;
+	}
+
+	found = 0;
+
+	for (i = 'p'; i <= 'z'; i++) {
+		for (j = '0'; j <= 'f'; j++) {
+			if (j == '9' + 1) {
+				j = 'a';
+			}
+			fmt_buf(pty, sizeof(pty), "/dev/pty%c%c", i, j);
+			fmt_buf(tty, sizeof(tty), "/dev/tty%c%c", i, j);
+			if ((*master = open(pty, O_RDWR|O_NOCTTY)) >= 0) {
+				*slave = open(tty, O_RDWR|O_NOCTTY);
+				if (*slave >= 0) {
+					found = 1;
+					break;
+				}
+			}
+		}
+		if (found) {
+			break;
+		}
+	}
+	if (!found) {
+		return -1;
+	}
+
+	if (name) {
+		strcpy(name, tty);
+	}
+
+	return 0;
+}
+/*
+ * See if a console taken from the kernel command line maps
+ * to a character device we know about, and if we can open it.
+ */
+static int isconsole(char *s, char *res, int rlen)
+{
+	struct consdev *c;
+	int l, sl, i, fd;
+	char *p, *q;
+
+	sl = strlen(s);
+
+	for (c = consdev; c->cmdline; c++) {
+		l = strlen(c->cmdline);
+		if (sl <= l) {
+			continue;
+		}
+		p = s + l;
+		if (strncmp(s, c->cmdline, l) != 0 || *p < '0' || *p > '9') {
+			continue;
+		}
+		for (i = 0; i < 2; i++) {
+			if ((i ? c->dev1 : c->dev2) == NULL) {
+				continue;
+			}
+			fmt_buf(res, rlen, i ? c->dev1 : c->dev2, p);
+			if ((q = strchr(res, ',')) != NULL) {
+				*q = 0;
+			}
+			if ((fd = open(res, O_RDONLY|O_NONBLOCK)) >= 0) {
+				close(fd);
+
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Find out the _real_ console(s). Assume that stdin is connected to
+ * the console device (/dev/console).
+ */
+static int consolenames(struct real_cons *cons, int max_consoles)
+{
+	struct stat st, st2;
+	char buf[KERNEL_COMMAND_LENGTH];
+	char *p, *q;
+	int didmount = 0;
+	int n;
+	int fd;
+	int considx, num_consoles = 0;
+
+	/*
+	 * Read /proc/cmdline.
+	 */
+	stat("/", &st);
+	if (stat("/proc", &st2) < 0) {
+		fmt_fd(2, "bootlogd: /proc: %s\n", fmt_err(errno));
+
+		return 0;
+	}
+	if (st.st_dev == st2.st_dev) {
+		if (mount("proc", "/proc", "proc", 0, NULL) < 0) {
+			fmt_fd(2, "bootlogd: mount /proc: %s\n", fmt_err(errno));
+
+			return -1;
+		}
+		didmount = 1;
+	}
+
+	n = -1;
+	if ((fd = open("/proc/cmdline", O_RDONLY)) < 0) {
+		fmt_fd(2, "bootlogd: /proc/cmdline: %s\n", fmt_err(errno));
+	}
+	else {
+		buf[0] = 0;
+		if ((n = read(fd, buf, KERNEL_COMMAND_LENGTH - 1)) < 0) {
+			fmt_fd(2, "bootlogd: /proc/cmdline: %s\n", fmt_err(errno));
+		}
+		close(fd);
+	}
+	if (didmount) {
+		umount("/proc");
+	}
+
+	if (n < 0) {
+		return 0;
+	}
+
+	/*
+	 * OK, so find console= in /proc/cmdline.
+	 * Parse in reverse, opening as we go.
+	 */
+	p = buf + n;
+	*p-- = 0;
+	while (p >= buf) {
+		if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			*p-- = 0;
+			continue;
+		}
+		if (strncmp(p, "console=", 8) == 0 &&
+				isconsole(p + 8, cons[num_consoles].name, sizeof(cons[num_consoles].name)))
+		{
+			/*
+			 * Suppress duplicates
+			 */
+			for (considx = 0; considx < num_consoles; considx++) {
+				if (!strcmp(cons[num_consoles].name, cons[considx].name)) {
+					goto dontuse;
+				}
+			}
+			/*
+			 * Line settings, as in console=ttyS0,115200n8
+			 */
+			cons[num_consoles].baud = 0;
+			if ((q = strchr(p + 8, ',')) != NULL) {
+				consopts(&cons[num_consoles], q + 1);
+			}
+
+			num_consoles++;
+			if (num_consoles >= max_consoles) {
+				break;
+			}
+		}
+dontuse:
+		p--;
+	}
+
+	if (num_consoles > 0) {
+		return num_consoles;
+	}
+
+	/*
+	 * Okay, no console on the command line -
+	 * guess the default console.
+	 */
+	for (n = 0; defcons[n]; n++) {
+		if (isconsole(defcons[n], cons[0].name, sizeof(cons[0].name))) {
+			return 1;
+		}
+	}
+
+	fmt_fd(2, "bootlogd: cannot deduce real console device\n");
+
+	return 0;
+}
+
+/*
+ * Milliseconds on the monotonic clock.
+ */
+long long mononow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long monousec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Parse a kernel priority prefix ("<3>") at the start of a line.
+ */
+int parseprio(char *s, int len)
+{
+	if (len >= 3 && s[0] == '<' && s[1] >= '0' && s[1] <= '7' && s[2] == '>') {
+		return s[1] - '0';
+	}
+
+	return -1;
+}
+
+/*
+ * Write to a real console, through its transform.
+ * Returns -1 if the console is lost.
+ */
+static int consfeed(struct real_cons *c, int pts, char *p, int n)
+{
+	if (c->filt.flags) {
+		if (c->filt.nhold == 0) {
+			c->held = lastinput;
+		}
+		n = filter_run(&c->filt, (unsigned char *)p, n, consbuf);
+		p = (char *)consbuf;
+	}
+
+	return consout(c, pts, p, n);
+}
+
+/*
+ * Hand an assembled line (or a piece of one, if it was too long or
+ * we got tired of waiting for the newline) to the ring, for the sinks
+ * to pick up.
+ */
+static void emitline(int nl)
+{
+	static char out[LOGLINE_MAX + 1];
+	struct ruleres res;
+	struct logrec rec;
+	char mark[LOGLINE_MAX];
+	int i;
+
+	rules_line((unsigned char *)linebuf, linelen, linecont, &res);
+	if (!linecont) {
+		tl_line(linebuf, linelen, linemono);
+		if (nl && unitsfile) {
+			units_line(linebuf, linelen, linemono, mononow());
+		}
+		if (nl && latfile) {
+			lat_line(linebuf, linelen, readus);
+		}
+		lineprio = parseprio(linebuf, linelen);
+		lineroute = sink_route(lineprio);
+		tpl_line(linebuf, linelen, lineprio, linemono);
+	}
+	lineroute |= res.route;
+	if (lineprio >= 0 && lineprio <= URGENT_PRIO) {
+		res.flags |= ACT_URGENT;
+	}
+	if (res.flags & ACT_URGENT) {
+		urgent_lines++;
+	}
+	if ((res.flags & ACT_DETACH) && detaching == NULL) {
+		detaching = "marker";
+	}
+
+	/* the consoles that only get masked text */
+	for (i = 0; i < num_consoles; i++) {
+		if (cons[i].redact && cons[i].fd >= 0) {
+			memcpy(out, linebuf, linelen);
+			out[linelen] = '\n';
+			if (consfeed(&cons[i], pts, out, linelen + nl) < 0) {
+				consoles_left--;
+			}
+		}
+	}
+
+	rec.time = linetime;
+	rec.boot = lineboot;
+	rec.flags = res.flags | (nl ? REC_NL : 0) | (linecont ? REC_CONT : 0);
+	rec.route = lineroute;
+	rec.prio = lineprio;
+	rec.len = linelen;
+	ring_append(&rec, linebuf);
+	linecont = !nl;
+	linelen = 0;
+
+	if (res.flags & ACT_MARK) {
+		rec.flags = REC_NL | (res.flags & (ACT_SYNC|ACT_URGENT));
+		rec.len = fmt_buf(mark, sizeof(mark), "bootlogd: [mark] %s", res.mark);
+		if (rec.len >= (int)sizeof(mark)) {
+			rec.len = sizeof(mark) - 1;
+		}
+		ring_append(&rec, mark);
+		linecont = 0;
+	}
+}
+
+/*
+ * Hand on the line so far as a piece, but keep back its end if a
+ * rule pattern could start there, so the rules see the pattern
+ * whole in the next piece.
+ */
+static void emitpiece(void)
+{
+	char tail[LOGLINE_MAX];
+	int keep;
+
+	keep = rules_tail((unsigned char *)linebuf, linelen);
+	if (keep >= linelen) {
+		if (linelen < LOGLINE_MAX) {
+			return;
+		}
+		keep = linelen - 1;
+	}
+	memcpy(tail, linebuf + linelen - keep, keep);
+	linelen -= keep;
+	emitline(0);
+	memcpy(linebuf, tail, keep);
+	linelen = keep;
+}
+
+/*
+ * Filter the data and assemble it into lines.
+ */
+static void writelog(unsigned char *ptr, int len)
+{
+	static unsigned char buf[sizeof(readbuf) + FILTER_SLACK];
+	struct timespec ts;
+	unsigned char *p, *end, *nl;
+	int n, chunk;
+
+	while (len > 0) {
+		chunk = len < (int)sizeof(readbuf) ? len : (int)sizeof(readbuf);
+		n = filter_run(&logfilter, ptr, chunk, buf);
+		ptr += chunk;
+		len -= chunk;
+
+		/* a line at a time, or as much of one as fits */
+		for (p = buf, end = buf + n; p < end; p += n) {
+			if (linelen == 0 && !linecont) {
+				clock_gettime(CLOCK_REALTIME, &linetime);
+				if (timeline || unitsfile || tpldir) {
+					linemono = mononow();
+				}
+				if (boottime) {
+					clock_gettime(CLOCK_BOOTTIME, &ts);
+					lineboot = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+				}
+			}
+			n = end - p;
+			if (n > LOGLINE_MAX - linelen) {
+				n = LOGLINE_MAX - linelen;
+			}
+			if ((nl = memchr(p, '\n', n)) != NULL) {
+				n = nl - p;
+			}
+			memcpy(linebuf + linelen, p, n);
+			linelen += n;
+			if (nl != NULL) {
+				emitline(1);
+				n++;
+			}
+			else if (linelen == LOGLINE_MAX) {
+				emitpiece();
+			}
+		}
+	}
+}
+
+/*
+ * Write out a partial line that has been waiting for its newline.
+ */
+static void flushline(void)
+{
+	if (linelen > 0) {
+		emitline(0);
+	}
+}
+
+/*
+ * We just read n bytes from the pty. If that was little and came
+ * right after the read before it, we are in a flood of small writes
+ * (a printk at a time): keep reading for up to readwait microseconds,
+ * so the consoles and the log get one batch instead of many.
+ * Returns the number of bytes in readbuf.
+ */
+static int gather(int ptm, int n)
+{
+	struct timeval tv;
+	fd_set fds;
+	long long now, deadline;
+	int m;
+
+	now = monousec();
+	if (readwait <= 0 || n >= GATHER_MIN || now - lastread > readwait) {
+		lastread = now;
+		return n;
+	}
+	gathered++;
+	deadline = now + readwait;
+	while (n < GATHER_MIN && now < deadline) {
+		tv.tv_sec = 0;
+		tv.tv_usec = deadline - now;
+		FD_ZERO(&fds);
+		FD_SET(ptm, &fds);
+		capture_calls++;
+		if (select(ptm + 1, &fds, NULL, NULL, &tv) <= 0) {
+			break;
+		}
+		capture_calls++;
+		if ((m = read(ptm, readbuf + n, sizeof(readbuf) - n)) <= 0) {
+			break;
+		}
+		bytes_read += m;
+		n += m;
+		now = monousec();
+	}
+	lastread = monousec();
+
+	return n;
+}
+
+/*
+ * Parse a list of CPUs, as in "0-1,3".
+ */
+static int parsecpus(char *s, cpu_set_t *set)
+{
+	char *p;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	do {
+		lo = hi = strtol(s, &p, 10);
+		if (p == s) {
+			return -1;
+		}
+		if (*p == '-') {
+			s = p + 1;
+			hi = strtol(s, &p, 10);
+			if (p == s) {
+				return -1;
+			}
+		}
+		if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+			return -1;
+		}
+		for (; lo <= hi; lo++) {
+			CPU_SET(lo, set);
+		}
+		s = p + 1;
+	} while (*p == ',');
+
+	return *p ? -1 : 0;
+}
+
+/*
+ * Make sure the capture loop gets the CPU and never waits for a page.
+ * None of this is fatal: we would rather log slowly than not at all.
+ */
+static int rtset;		/* SCHED_FIFO took */
+
+static void rt_setup(void)
+{
+	struct sched_param sp;
+
+	if (pinned && sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+		fmt_fd(2, "bootlogd: sched_setaffinity: %s\n", fmt_err(errno));
+	}
+	if (rtprio) {
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = rtprio;
+		if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0) {
+			fmt_fd(2, "bootlogd: sched_setscheduler: %s\n", fmt_err(errno));
+		}
+		else {
+			rtset = 1;
+		}
+	}
+	if (lockmem && mlockall(MCL_CURRENT|MCL_FUTURE) < 0) {
+		fmt_fd(2, "bootlogd: mlockall: %s\n", fmt_err(errno));
+	}
+}
+
+/*
+ * Write out to the sinks at normal priority: formatting the lines,
+ * the logfiles and the sockets are not worth holding the rest of the
+ * machine up for, only reading the console and copying it out are.
+ */
+static void rt_sinks(void)
+{
+	struct sched_param sp;
+
+	memset(&sp, 0, sizeof(sp));
+	if (rtset) {
+		sched_setscheduler(0, SCHED_OTHER, &sp);
+	}
+	sinks_pump();
+	if (rtset) {
+		sp.sched_priority = rtprio;
+		sched_setscheduler(0, SCHED_FIFO, &sp);
+	}
+}
+
+/*
+ * In a child we fork off (hooks, snapshots, syncs): back to normal
+ * priority, and off the CPUs the capture loop was pinned to, if
+ * there are others.
+ */
+void rt_undo(void)
+{
+	struct sched_param sp;
+	cpu_set_t set;
+	int i;
+
+	if (rtprio) {
+		memset(&sp, 0, sizeof(sp));
+		sched_setscheduler(0, SCHED_OTHER, &sp);
+	}
+	if (pinned && sched_getaffinity(0, sizeof(set), &set) == 0) {
+		CPU_ZERO(&set);
+		for (i = 0; i < CPU_SETSIZE && i < sysconf(_SC_NPROCESSORS_CONF); i++) {
+			if (!CPU_ISSET(i, &cpus)) {
+				CPU_SET(i, &set);
+			}
+		}
+		if (CPU_COUNT(&set) > 0) {
+			sched_setaffinity(0, sizeof(set), &set);
+		}
+	}
+}
+
+void snapshot(const char *path)
+{
+	/* the line being assembled is part of it */
+	flushline();
+	sink_snapshot(path ? path : snapfile);
+}
+
+/*
+ * Hand n bytes from readbuf to the real consoles, through their
+ * transform if they have one, and assemble the lines for the
+ * logfiles. Returns the number of consoles lost on the way.
+ */
+static int fanout(int pts, int n)
+{
+	int considx, lost = 0;
+
+	lastinput = mononow();
+	if (latfile) {
+		readus = monousec();
+	}
+	for (considx = 0; considx < num_consoles; considx++) {
+		if (cons[considx].fd < 0) {
+			continue;
+		}
+		if (cons[considx].redact) {
+			/* gets the lines, from emitline() */
+			continue;
+		}
+		if (consfeed(&cons[considx], pts, readbuf, n) < 0) {
+			lost++;
+		}
+		else if (latfile) {
+			lat_console(monousec() - readus);
+		}
+	}
+	writelog((unsigned char *)readbuf, n);
+
+	return lost;
+}
+
+/*
+ * Read the pty until it has been quiet for DRAIN_QUIET msecs,
+ * or until the deadline.
+ */
+static void drain(int ptm, int pts, long long deadline)
+{
+	struct timeval tv;
+	fd_set fds;
+	long long left;
+	int n;
+
+	while ((left = deadline - mononow()) > 0) {
+		if (left > DRAIN_QUIET) {
+			left = DRAIN_QUIET;
+		}
+		tv.tv_sec = 0;
+		tv.tv_usec = left * 1000;
+		FD_ZERO(&fds);
+		FD_SET(ptm, &fds);
+		if (select(ptm + 1, &fds, NULL, NULL, &tv) <= 0) {
+			break;
+		}
+		if ((n = read(ptm, readbuf, sizeof(readbuf))) <= 0) {
+			break;
+		}
+		bytes_read += n;
+		drain_bytes += n;
+		fanout(pts, n);
+	}
+}
+
+#ifndef TINY
+/*
+ * The statistics, as they go in the -S file.
+ */
+void bootlogd_stats(FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "bytes_read %lu\n", bytes_read);
+	fprintf(fp, "capture_syscalls %lu\n", capture_calls);
+	fprintf(fp, "syscalls_per_mb %.1f\n",
+			bytes_read ? capture_calls * 1048576.0 / bytes_read : 0.0);
+	fprintf(fp, "reads_gathered %lu\n", gathered);
+	fprintf(fp, "drain_bytes %lu\n", drain_bytes);
+	fprintf(fp, "drain_ms %lld\n", drain_ms);
+	fprintf(fp, "fallback_lines %lu\n", fallback_lines);
+	if (detaching) {
+		fprintf(fp, "detached %s\n", detaching);
+	}
+	fprintf(fp, "urgent_lines %lu\n", urgent_lines);
+	fprintf(fp, "ring_dropped %lu\n", ringdropped);
+	sinks_stats(fp);
+	rules_stats(fp);
+	for (i = 0; i < num_consoles; i++) {
+		fprintf(fp, "console %s written %lu dropped_lines %lu collapsed %lu skipped_lines %lu dropped_bytes %lu\n",
+				cons[i].name, cons[i].written, cons[i].filt.dropped,
+				cons[i].filt.collapsed, cons[i].skipped, cons[i].qdropped);
+		if (cons[i].baud) {
+			fprintf(fp, "console %s baud %d lag_ms %ld lag_max_ms %ld lag_avg_ms %.1f\n",
+					cons[i].name, cons[i].baud, cons[i].lagcur, cons[i].lagmax,
+					cons[i].lagn ? cons[i].lagsum / cons[i].lagn : 0.0);
+		}
+	}
+}
+
+static void writestats(void)
+{
+	FILE *fp;
+
+	if (statsfile == NULL || (fp = fopen(statsfile, "w")) == NULL) {
+		return;
+	}
+	bootlogd_stats(fp);
+	fclose(fp);
+}
+#else
+/* the small build keeps no statistics */
+static void writestats(void)
+{
+}
+#endif
+
+/*
+ * Parse the number an option takes, from lo to hi. Returns -1, after
+ * saying why, if it is no number or out of range.
+ */
+static int numarg(int opt, char *arg, long lo, long hi, int *val)
+{
+	char *end;
+	long l;
+
+	errno = 0;
+	l = strtol(arg, &end, 10);
+	if (end == arg || *end || errno || l < lo || l > hi) {
+		fmt_fd(2, "bootlogd: -%c %s: out of range\n", opt, arg);
+		return -1;
+	}
+	*val = l;
+
+	return 0;
+}
+
+/*
+ * The log sink comes first, whatever the options add after it.
+ */
+static struct sink *getlogsink(void)
+{
+	if (logsink == NULL) {
+		logsink = sink_add("log", LOGFILE);
+		logsink->all = 1;
+	}
+
+	return logsink;
+}
+
+/*
+ * Take one of the options of bootlogd, by its letter. Returns -1,
+ * after saying why, if it is no good.
+ */
+int bootlogd_option(int opt, char *arg)
+{
+	struct sink *log = getlogsink();
+
+	switch (opt) {
+		case 'l':
+			log->path = arg;
+			break;
+		case 'r':
+			log->rotate = 1;
+			break;
+		case 'c':
+			createlogfile = 1;
+			break;
+		case 's':
+			syncalot = 1;
+			log->sync = 1;
+			break;
+		case 'w':
+			return numarg(opt, arg, 0, 999999, &batchwin);
+		case 'L':
+			return numarg(opt, arg, 0, 999999, &readwait);
+		case 'R':
+			return numarg(opt, arg, sched_get_priority_min(SCHED_FIFO),
+					sched_get_priority_max(SCHED_FIFO), &rtprio);
+		case 'm':
+			lockmem = 1;
+			break;
+		case 'D':
+			return numarg(opt, arg, 0, 999999, &drainwait);
+		case 'F':
+			fallback = arg;
+			break;
+		case 'i':
+			return numarg(opt, arg, 0, 999999, &idlewait);
+		case 'z':
+			snapfile = arg;
+			break;
+		case 'C':
+			if (parsecpus(arg, &cpus) < 0) {
+				fmt_fd(2, "bootlogd: -C %s: bad cpu list\n", arg);
+				return -1;
+			}
+			pinned = 1;
+			break;
+		case 'T':
+			return parsetrans(arg);
+#ifndef TINY
+		/* what the small build leaves out */
+		case 'o':
+			return sink_parse(arg);
+		case 't':
+			return rules_load(arg);
+		case 'S':
+			statsfile = arg;
+			break;
+		case 'f':
+			ctlfile = arg;
+			break;
+		case 'B':
+			timeline = arg;
+			break;
+		case 'U':
+			unitsfile = arg;
+			break;
+		case 'M':
+			tpldir = arg;
+			break;
+		case 'K':
+			return numarg(opt, arg, 1, 32, &tplkeep);
+		case 'k':
+			latfile = arg;
+			break;
+#endif
+		default:
+			fmt_fd(2, "bootlogd: -%c: no such option\n", opt);
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Open the consoles, grab a pty and redirect console messages to it.
+ * Returns -1, after saying why, if we cannot run.
+ */
+int bootlogd_init(void)
+{
+	char buf[1024];
+	int considx, n;
+
+	getlogsink();
+	if (rules_bind() < 0) {
+		return -1;
+	}
+	filter_init(&logfilter, FLT_STRIP|FLT_NOCR, 7);
+
+	if ((num_consoles = consolenames(cons, MAX_CONSOLES)) <= 0) {
+		return -1;
+	}
+	consoles_left = num_consoles;
+	for (considx = 0; considx < num_consoles; considx++) {
+		if (strcmp(cons[considx].name, "/dev/tty0") == 0) {
+			strcpy(cons[considx].name, "/dev/tty1");
+		}
+		if (strcmp(cons[considx].name, "/dev/vc/0") == 0) {
+			strcpy(cons[considx].name, "/dev/vc/1");
+		}
+
+		settrans(&cons[considx]);
+		if (consopen(&cons[considx]) < 0) {
+			fmt_fd(2, "bootlogd: %s: %s\n",
+					cons[considx].name, fmt_err(errno));
+			consoles_left--;
+		}
+	}
+	if (!consoles_left) {
+		return -1;
+	}
+
+	buf[0] = 0;
+	if (findpty(&ptm, &pts, buf) < 0) {
+		fmt_fd(2, "bootlogd: cannot allocate pseudo tty: %s\n", fmt_err(errno));
+
+		return -1;
+	}
+
+	(void)ioctl(0, TIOCCONS, NULL);
+	/* Work around bug in 2.1/2.2 kernels. Fixed in 2.2.13 and 2.3.18 */
+	if ((n = open("/dev/tty0", O_RDWR)) >= 0) {
+		(void)ioctl(n, TIOCCONS, NULL);
+		close(n);
+	}
+	if (ioctl(pts, TIOCCONS, NULL) < 0) {
+		fmt_fd(2, "bootlogd: ioctl(%s, TIOCCONS): %s\n", buf, fmt_err(errno));
+
+		return -1;
+	}
+	if (ctlfile && ctl_open(ctlfile) < 0) {
+		return -1;
+	}
+	rt_setup();
+	lastinput = mononow();
+	if (timeline) {
+		tl_start(lastinput);
+	}
+	if (unitsfile) {
+		units_start(lastinput);
+	}
+	if (tpldir) {
+		tpl_start(tpldir, tplkeep);
+	}
+	if (latfile) {
+		/* just instruments, we can do without */
+		lat_open();
+	}
+
+	return 0;
+}
+
+static void addfd(struct pollfd *fds, int *n, int max, int fd, int events)
+{
+	if (*n < max) {
+		fds[*n].fd = fd;
+		fds[*n].events = events;
+		fds[*n].revents = 0;
+		(*n)++;
+	}
+}
+
+/*
+ * The fds to wait for: the pty, the fifos, and the consoles that
+ * have output queued. Returns how many.
+ */
+int bootlogd_fds(struct pollfd *fds, int max)
+{
+	int considx, n = 0;
+
+	addfd(fds, &n, max, ptm, POLLIN);
+	if (ctl_fd >= 0) {
+		addfd(fds, &n, max, ctl_fd, POLLIN);
+	}
+	if (lat_fd >= 0) {
+		addfd(fds, &n, max, lat_fd, POLLIN);
+	}
+	for (considx = 0; considx < num_consoles; considx++) {
+		if (cons[considx].fd >= 0 && cons[considx].qlen > 0 && !cons[considx].pace) {
+			addfd(fds, &n, max, cons[considx].fd, POLLOUT);
+		}
+	}
+
+	return n;
+}
+
+/*
+ * How long to wait for them, in msecs.
+ */
+int bootlogd_timeout(void)
+{
+	long long now;
+	int considx, n, timeout;
+
+	/*
+	 * We timeout after half a second if we still need to
+	 * open the logfile. There might be buffered messages
+	 * we want to write.
+	 */
+	timeout = 500;
+	/*
+	 * Wake up in time to end a batch window.
+	 */
+	if ((n = sinks_timeout()) >= 0 && n < timeout) {
+		timeout = n;
+	}
+	/*
+	 * And to let out what the console transforms hold.
+	 */
+	now = mononow();
+	for (considx = 0; considx < num_consoles; considx++) {
+		if (cons[considx].filt.nhold == 0) {
+			continue;
+		}
+		n = cons[considx].held + HOLD_MS - now;
+		if (n < 0) {
+			n = 0;
+		}
+		if (n < timeout) {
+			timeout = n;
+		}
+	}
+	/*
+	 * And to top up the paced consoles.
+	 */
+	if ((n = constimeout(now)) >= 0 && n < timeout) {
+		timeout = n;
+	}
+
+	return timeout;
+}
+
+/*
+ * Whether fd came back ready from the wait.
+ */
+static int isready(struct pollfd *fds, int nfds, int fd)
+{
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		if (fds[i].fd == fd) {
+			return fds[i].revents != 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Deal with what came back from the wait, and with what is due.
+ * Returns -1 once we are done: the last console is gone, or we
+ * are detaching.
+ */
+int bootlogd_run(struct pollfd *fds, int nfds)
+{
+	long long now;
+	int considx, i, m, n;
+
+	capture_calls++;
+	for (n = i = 0; i < nfds; i++) {
+		n += fds[i].revents != 0;
+	}
+	rules_reap();
+	if (n > 0 && ctl_fd >= 0 && isready(fds, nfds, ctl_fd)) {
+		ctl_read();
+	}
+	if (n > 0 && lat_fd >= 0 && isready(fds, nfds, lat_fd)) {
+		lat_read(monousec());
+	}
+	if (idlewait > 0 && mononow() - lastinput >= idlewait * 1000LL) {
+		detaching = "idle";
+	}
+	if (n == 0 && mononow() - lastinput >= 500) {
+		/*
+		 * Nothing new for a while: don't sit on
+		 * the start of a line (a prompt, probably).
+		 */
+		if (linelen > 0) {
+			emitpiece();
+		}
+	}
+	for (considx = 0; n > 0 && considx < num_consoles; considx++) {
+		if (cons[considx].fd >= 0 && isready(fds, nfds, cons[considx].fd) &&
+				consflush(&cons[considx], pts) < 0) {
+			consoles_left--;
+		}
+	}
+	consoles_left -= conspace(pts, mononow());
+	if (n > 0 && isready(fds, nfds, ptm)) {
+		capture_calls++;
+		if ((n = read(ptm, readbuf, sizeof(readbuf))) >= 0) {
+			bytes_read += n;
+			n = gather(ptm, n);
+			consoles_left -= fanout(pts, n);
+		}
+	}
+
+	/*
+	 * Let out partial lines the consoles have been
+	 * holding back for too long.
+	 */
+	now = mononow();
+	for (considx = 0; considx < num_consoles; considx++) {
+		if (cons[considx].fd < 0 || cons[considx].filt.nhold == 0 ||
+				now - cons[considx].held < HOLD_MS) {
+			continue;
+		}
+		m = filter_flush(&cons[considx].filt, consbuf);
+		if (consout(&cons[considx], pts, (char *)consbuf, m) < 0) {
+			consoles_left--;
+		}
+	}
+
+	/*
+	 * Write out what we can. Sinks whose file is not
+	 * there yet keep their lines buffered in the ring.
+	 */
+	rt_sinks();
+
+	return consoles_left <= 0 || detaching ? -1 : 0;
+}
+
+/*
+ * The -S, -B, -U and -k reports, as they stand (SIGUSR1).
+ */
+void bootlogd_report(void)
+{
+	writestats();
+	tl_report(timeline, mononow());
+	units_report(unitsfile, mononow());
+	lat_report(latfile);
+}
+
+/*
+ * A snapshot of the ring, to the -z file if path is NULL (SIGUSR2).
+ */
+void bootlogd_snapshot(const char *path)
+{
+	snapshot(path);
+}
+
+/*
+ * Take in what is still on its way, give /dev/console back,
+ * and take in what got in before that.
+ */
+void bootlogd_drain(void)
+{
+	long long drainstart;
+	int fd;
+
+	drainstart = mononow();
+	drain(ptm, pts, drainstart + drainwait);
+	if ((fd = open("/dev/console", O_RDWR|O_NOCTTY)) >= 0) {
+		(void)ioctl(fd, TIOCCONS, NULL);
+		close(fd);
+	}
+	drain(ptm, pts, drainstart + drainwait);
+	drain_ms = mononow() - drainstart;
+}
+
+/*
+ * Write out what is left, whatever the logfiles could not take to
+ * the fallback file, then the reports, and close everything.
+ */
+void bootlogd_shutdown(void)
+{
+	int considx, i, m;
+
+	flushline();
+	sinks_pump();
+	fallback_lines = sinks_fallback(fallback);
+	sinks_close();
+	for (considx = 0; considx < num_consoles; considx++) {
+		if (cons[considx].fd >= 0 && (m = filter_flush(&cons[considx].filt, consbuf)) > 0) {
+			consout(&cons[considx], pts, (char *)consbuf, m);
+		}
+		consdrain(&cons[considx], pts);
+	}
+
+	ctl_close();
+	writestats();
+	tl_report(timeline, mononow());
+	units_report(unitsfile, mononow());
+	tpl_finish();
+	lat_report(latfile);
+	lat_close();
+	for (i = 0; i < nsinks; i++) {
+		if (sinks[i].cur.lost) {
+			fmt_fd(2, "bootlogd: %s: %lu lines lost\n", sinks[i].name, sinks[i].cur.lost);
+		}
+	}
+
+	close(pts);
+	close(ptm);
+	for (considx = 0; considx < num_consoles; considx++) {
+		close(cons[considx].fd);
+	}
+}
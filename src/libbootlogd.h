@@ -0,0 +1,55 @@
+/*
+ * libbootlogd.h	The capture core of bootlogd, for an init system
+ *		that would rather run it in its own event loop than
+ *		start bootlogd as a process.
+ *
+ *		bootlogd_option() takes the options bootlogd takes, by
+ *		their letter: bootlogd_option('l', "/run/log/boot.log").
+ *		bootlogd_init() grabs a pty and takes over the console;
+ *		from then on the caller polls the fds bootlogd_fds() hands
+ *		out, for at most bootlogd_timeout() msecs, and calls
+ *		bootlogd_run() with what came back. Once done (or when
+ *		bootlogd_run() returns -1), bootlogd_drain() gives the
+ *		console back and bootlogd_shutdown() writes out what is
+ *		left and closes everything.
+ *
+ *		Nothing here installs signal handlers. Children are
+ *		forked for hook rules, for snapshots and, with -R, to sync
+ *		the logfiles; they are waited for by their pid only, so
+ *		the caller's own children are left alone, and a caller
+ *		that reaps whatever exits (waitpid(-1, ...)) does no harm.
+ *		The snapshot child forks again and is never waited for.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#ifndef LIBBOOTLOGD_H
+#define LIBBOOTLOGD_H
+
+#include <stdio.h>
+#include <poll.h>
+
+/*
+ * Most fds bootlogd_fds() hands out: the pty, the control fifo,
+ * the latency fifo and the consoles.
+ */
+#define BOOTLOGD_MAXFDS	19
+
+int  bootlogd_option(int opt, char *arg);
+int  bootlogd_init(void);
+int  bootlogd_fds(struct pollfd *fds, int max);
+int  bootlogd_timeout(void);
+int  bootlogd_run(struct pollfd *fds, int nfds);
+void bootlogd_report(void);
+void bootlogd_snapshot(const char *path);
+void bootlogd_stats(FILE *fp);
+void bootlogd_drain(void);
+void bootlogd_shutdown(void);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+ * match.c	Compiled multi-pattern matcher (Aho-Corasick).
+ *
+ *		Patterns are collected with match_add(), then turned into a
+ *		complete DFA by match_compile(). Scanning a buffer is a single
+ *		table lookup per byte, which keeps the matcher cheap enough to
+ *		run over every line we capture.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "match.h"
+
+void match_init(struct matcher *m)
+{
+	memset(m, 0, sizeof(*m));
+}
+
+/*
+ * Add a pattern. Returns the pattern id, or -1 on error.
+ */
+int match_add(struct matcher *m, const char *pat, int len)
+{
+	unsigned char **np;
+	int *nl;
+
+	if (len <= 0 || m->delta) {
+		return -1;
+	}
+	if (m->npat == m->maxpat) {
+		m->maxpat = m->maxpat ? m->maxpat * 2 : 16;
+		np = realloc(m->pat, m->maxpat * sizeof(*np));
+		if (np == NULL) {
+			return -1;
+		}
+		m->pat = np;
+		nl = realloc(m->patlen, m->maxpat * sizeof(*nl));
+		if (nl == NULL) {
+			return -1;
+		}
+		m->patlen = nl;
+	}
+	if ((m->pat[m->npat] = malloc(len)) == NULL) {
+		return -1;
+	}
+	memcpy(m->pat[m->npat], pat, len);
+	m->patlen[m->npat] = len;
+
+	return m->npat++;
+}
+
+/*
+ * Build the DFA. Returns 0 on success, -1 if out of memory.
+ */
+int match_compile(struct matcher *m)
+{
+	int *delta, *fail, *queue, *own, *ownnext;
+	int maxstates, nstates, ncls;
+	int i, j, s, t, c, head, tail, nout, pos;
+
+	/*
+	 * Byte classes: class 0 is every byte that appears in no pattern.
+	 */
+	memset(m->cls, 0, sizeof(m->cls));
+	ncls = 1;
+	maxstates = 1;
+	for (i = 0; i < m->npat; i++) {
+		for (j = 0; j < m->patlen[i]; j++) {
+			if (m->cls[m->pat[i][j]] == 0) {
+				m->cls[m->pat[i][j]] = ncls++;
+			}
+		}
+		maxstates += m->patlen[i];
+	}
+
+	delta   = malloc((size_t)maxstates * ncls * sizeof(int));
+	fail    = malloc(maxstates * sizeof(int));
+	queue   = malloc(maxstates * sizeof(int));
+	own     = malloc(maxstates * sizeof(int));
+	ownnext = malloc((m->npat + 1) * sizeof(int));
+	m->depth = calloc(maxstates, sizeof(int));
+	if (!delta || !fail || !queue || !own || !ownnext || !m->depth) {
+		goto oom;
+	}
+
+	/*
+	 * Build the trie; -1 marks a missing edge.
+	 */
+	for (i = 0; i < maxstates * ncls; i++) {
+		delta[i] = -1;
+	}
+	for (i = 0; i < maxstates; i++) {
+		own[i] = -1;
+	}
+	nstates = 1;
+	for (i = 0; i < m->npat; i++) {
+		s = 0;
+		for (j = 0; j < m->patlen[i]; j++) {
+			c = m->cls[m->pat[i][j]];
+			if (delta[s * ncls + c] < 0) {
+				m->depth[nstates] = j + 1;
+				delta[s * ncls + c] = nstates++;
+			}
+			s = delta[s * ncls + c];
+		}
+		ownnext[i] = own[s];
+		own[s] = i;
+	}
+
+	/*
+	 * Breadth-first pass: compute failure links and fill in the
+	 * missing edges so every state has a transition for every class.
+	 */
+	head = tail = 0;
+	fail[0] = 0;
+	for (c = 0; c < ncls; c++) {
+		if ((t = delta[c]) < 0) {
+			delta[c] = 0;
+		}
+		else {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+	while (head < tail) {
+		s = queue[head++];
+		for (c = 0; c < ncls; c++) {
+			t = delta[s * ncls + c];
+			if (t < 0) {
+				delta[s * ncls + c] = delta[fail[s] * ncls + c];
+			}
+			else {
+				fail[t] = delta[fail[s] * ncls + c];
+				queue[tail++] = t;
+			}
+		}
+	}
+
+	/*
+	 * Output sets: a state reports its own patterns plus everything
+	 * its failure state reports. Failure states are always shallower,
+	 * so BFS order guarantees they are done first.
+	 */
+	m->outidx = calloc(nstates, sizeof(int));
+	m->outcnt = calloc(nstates, sizeof(int));
+	if (!m->outidx || !m->outcnt) {
+		goto oom;
+	}
+	nout = 0;
+	for (i = 0; i < tail; i++) {
+		s = queue[i];
+		for (j = own[s]; j >= 0; j = ownnext[j]) {
+			m->outcnt[s]++;
+		}
+		m->outcnt[s] += m->outcnt[fail[s]];
+		nout += m->outcnt[s];
+	}
+	m->out = malloc((nout + 1) * sizeof(int));
+	if (m->out == NULL) {
+		goto oom;
+	}
+	pos = 0;
+	for (i = 0; i < tail; i++) {
+		s = queue[i];
+		m->outidx[s] = pos;
+		for (j = own[s]; j >= 0; j = ownnext[j]) {
+			m->out[pos++] = j;
+		}
+		t = fail[s];
+		memcpy(m->out + pos, m->out + m->outidx[t], m->outcnt[t] * sizeof(int));
+		pos += m->outcnt[t];
+	}
+
+	/*
+	 * Store transitions as row offsets so the scan loop does not need
+	 * to multiply, and make them negative for states that report a
+	 * match so it needs only a sign test to know there is work to do.
+	 */
+	for (i = 0; i < nstates * ncls; i++) {
+		t = delta[i];
+		delta[i] = m->outcnt[t] ? -(t * ncls) - 1 : t * ncls;
+	}
+	m->delta = realloc(delta, (size_t)nstates * ncls * sizeof(int));
+	if (m->delta == NULL) {
+		m->delta = delta;
+	}
+	m->nstates = nstates;
+	m->nclasses = ncls;
+	free(fail);
+	free(queue);
+	free(own);
+	free(ownnext);
+
+	return 0;
+oom:
+	free(delta);
+	free(fail);
+	free(queue);
+	free(own);
+	free(ownnext);
+	free(m->outidx);
+	free(m->outcnt);
+	free(m->depth);
+	m->outidx = m->outcnt = m->depth = NULL;
+
+	return -1;
+}
+
+/*
+ * Run the automaton over a buffer, calling cb for every match.
+ * Returns the number of matches reported.
+ */
+int match_scan(const struct matcher *m, const unsigned char *s, size_t len,
+		match_cb cb, void *arg)
+{
+	const int *delta = m->delta;
+	const unsigned char *cls = m->cls;
+	int row = 0;
+	int found = 0;
+	int state;
+	size_t i;
+	int k;
+
+	if (delta == NULL || m->npat == 0) {
+		return 0;
+	}
+	for (i = 0; i < len; i++) {
+		row = delta[row + cls[s[i]]];
+		if (row >= 0) {
+			continue;
+		}
+		row = -row - 1;
+		state = row / m->nclasses;
+		for (k = 0; k < m->outcnt[state]; k++) {
+			found++;
+			if (cb && cb(m->out[m->outidx[state] + k], i + 1, arg)) {
+				return found;
+			}
+		}
+	}
+
+	return found;
+}
+
+/*
+ * How many bytes at the end of s could be the start of a pattern
+ * (the longest, if several could).
+ */
+int match_tail(const struct matcher *m, const unsigned char *s, size_t len)
+{
+	const int *delta = m->delta;
+	int row = 0;
+	size_t i;
+
+	if (delta == NULL || m->npat == 0) {
+		return 0;
+	}
+	for (i = 0; i < len; i++) {
+		row = delta[row + m->cls[s[i]]];
+		if (row < 0) {
+			row = -row - 1;
+		}
+	}
+
+	return m->depth[row / m->nclasses];
+}
+
+void match_free(struct matcher *m)
+{
+	int i;
+
+	for (i = 0; i < m->npat; i++) {
+		free(m->pat[i]);
+	}
+	free(m->pat);
+	free(m->patlen);
+	free(m->delta);
+	free(m->outidx);
+	free(m->outcnt);
+	free(m->out);
+	free(m->depth);
+	match_init(m);
+}
@@ -0,0 +1,53 @@
+/*
+ * match.h	Compiled multi-pattern matcher (Aho-Corasick).
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stddef.h>
+
+/*
+ * The automaton is built as a full DFA over byte classes: every byte
+ * that does not occur in any pattern shares a single class, so the
+ * transition table stays small even for hundreds of patterns, and a
+ * scan costs one table lookup per input byte.
+ */
+struct matcher {
+	int npat;		/* number of patterns added */
+	int maxpat;		/* allocated pattern slots */
+	unsigned char **pat;	/* pattern bytes (copies) */
+	int *patlen;		/* pattern lengths */
+
+	int nstates;		/* number of DFA states */
+	int nclasses;		/* number of byte classes */
+	unsigned char cls[256];	/* byte -> class */
+	int *delta;		/* nstates * nclasses transitions */
+	int *outidx;		/* per state: first entry in out[] */
+	int *outcnt;		/* per state: number of patterns ending here */
+	int *out;		/* flattened pattern id lists */
+	int *depth;		/* per state: length of the prefix it stands for */
+};
+
+/*
+ * Called for every match; end is the offset just past the match.
+ * Return non-zero to stop scanning.
+ */
+typedef int (*match_cb)(int id, size_t end, void *arg);
+
+void match_init(struct matcher *m);
+int  match_add(struct matcher *m, const char *pat, int len);
+int  match_compile(struct matcher *m);
+int  match_scan(const struct matcher *m, const unsigned char *s, size_t len,
+		match_cb cb, void *arg);
+int  match_tail(const struct matcher *m, const unsigned char *s, size_t len);
+void match_free(struct matcher *m);
+
+#endif
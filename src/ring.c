@@ -0,0 +1,169 @@
+/*
+ * ring.c	The in-memory store of captured lines.
+ *
+ *		Lines are kept as records in one circular buffer until every
+ *		sink that wants them has written them out. Each sink reads
+ *		through its own cursor; when the buffer is full the oldest
+ *		records are dropped, and a sink that had not got to them yet
+ *		is moved forward and told how many lines it lost.
+ *
+ *		Records never wrap around the end of the buffer: if one does
+ *		not fit, the rest of the buffer is skipped with a padding
+ *		record (or left alone if even a header does not fit).
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <string.h>
+#include "bootlogd.h"
+
+#define RECALIGN(n) (((n) + 7) & ~7UL)
+
+static char ringbuf[ 1 * 1024 * 1024 ]; /* MiB */
+
+static unsigned long long ringhead = 0;	/* bytes ever written */
+static unsigned long long ringtail = 0;	/* start of the oldest record */
+static unsigned long long ringseq = 0;		/* number of the next record */
+unsigned long ringdropped = 0;		/* records pushed out */
+
+/*
+ * Record at a position, or NULL if the rest of the buffer is padding.
+ */
+static struct logrec *recat(unsigned long long pos)
+{
+	unsigned long off = pos % sizeof(ringbuf);
+	struct logrec *rec;
+
+	if (sizeof(ringbuf) - off < sizeof(struct logrec)) {
+		return NULL;
+	}
+	rec = (struct logrec *)(ringbuf + off);
+	if (rec->flags & REC_PAD) {
+		return NULL;
+	}
+
+	return rec;
+}
+
+/*
+ * Size of the record at pos, up to the next one.
+ */
+static unsigned long recsize(unsigned long long pos)
+{
+	struct logrec *rec;
+
+	if ((rec = recat(pos)) == NULL) {
+		return sizeof(ringbuf) - pos % sizeof(ringbuf);
+	}
+
+	return RECALIGN(sizeof(struct logrec) + rec->len);
+}
+
+/*
+ * Append a record. The header is copied, the text follows it.
+ * Returns the stored record.
+ */
+struct logrec *ring_append(struct logrec *hdr, const char *text)
+{
+	unsigned long need = RECALIGN(sizeof(struct logrec) + hdr->len);
+	unsigned long off = ringhead % sizeof(ringbuf);
+	unsigned long left = sizeof(ringbuf) - off;
+	struct logrec *rec;
+
+	if (need > sizeof(ringbuf) / 2) {
+		return NULL;
+	}
+
+	/*
+	 * Skip to the start of the buffer if the record does not fit.
+	 */
+	if (left < need) {
+		while (ringhead + left - ringtail > sizeof(ringbuf)) {
+			if (recat(ringtail)) {
+				ringdropped++;
+			}
+			ringtail += recsize(ringtail);
+		}
+		if (left >= sizeof(struct logrec)) {
+			rec = (struct logrec *)(ringbuf + off);
+			rec->flags = REC_PAD;
+			rec->len = left - sizeof(struct logrec);
+		}
+		ringhead += left;
+		off = 0;
+	}
+
+	/*
+	 * Make room by dropping the oldest records.
+	 */
+	while (ringhead + need - ringtail > sizeof(ringbuf)) {
+		if (recat(ringtail)) {
+			ringdropped++;
+		}
+		ringtail += recsize(ringtail);
+	}
+
+	rec = (struct logrec *)(ringbuf + off);
+	memcpy(rec, hdr, sizeof(*rec));
+	rec->seq = ringseq++;
+	memcpy(REC_TEXT(rec), text, hdr->len);
+	ringhead += need;
+
+	return rec;
+}
+
+/*
+ * Start a cursor at the oldest record we still have.
+ */
+void ring_cursor(struct ringcur *cur)
+{
+	unsigned long long pos;
+
+	cur->pos = ringtail;
+	cur->seq = ringseq;
+	cur->lost = 0;
+	for (pos = ringtail; pos < ringhead; pos += recsize(pos)) {
+		if (recat(pos)) {
+			cur->seq = recat(pos)->seq;
+			break;
+		}
+	}
+}
+
+/*
+ * Next record for a cursor, or NULL if it has seen everything.
+ * The cursor does not move until ring_advance() is called, so the
+ * caller can give up on a record and retry it later.
+ */
+struct logrec *ring_next(struct ringcur *cur)
+{
+	struct logrec *rec;
+
+	if (cur->pos < ringtail) {
+		cur->pos = ringtail;
+	}
+	while (cur->pos < ringhead) {
+		if ((rec = recat(cur->pos)) != NULL) {
+			if (rec->seq > cur->seq) {
+				cur->lost += rec->seq - cur->seq;
+				cur->seq = rec->seq;
+			}
+			return rec;
+		}
+		cur->pos += recsize(cur->pos);
+	}
+
+	return NULL;
+}
+
+void ring_advance(struct ringcur *cur, struct logrec *rec)
+{
+	cur->pos += RECALIGN(sizeof(struct logrec) + rec->len);
+	cur->seq = rec->seq + 1;
+}
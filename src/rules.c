@@ -0,0 +1,456 @@
+/*
+ * rules.c	Pattern triggered actions on captured lines.
+ *
+ *		A rules file lists one rule per line:
+ *
+ *			action[:argument] pattern
+ *
+ *		All patterns are compiled into a single automaton, so every
+ *		assembled line is scanned once no matter how many rules
+ *		there are. Empty lines and lines starting with '#' are
+ *		ignored. In the pattern, \s stands for a space, \t for a tab
+ *		and \\ for a backslash. A pattern starting with ^ only
+ *		matches at the start of the line.
+ *
+ *		Redaction rules rewrite the line in place before it goes
+ *		anywhere else, so the other rules, the hooks and the logfile
+ *		only ever see the masked text. A line can reach us in pieces
+ *		(when it is too long, or its end is slow to come): the
+ *		caller holds back the end of a piece that could be the
+ *		start of a pattern (rules_tail()), and a redact:next that
+ *		runs into the end of a piece carries on into the next one.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include "bootlogd.h"
+#include "match.h"
+
+#define MAX_HOOKS 4
+#define REDACT_CHAR '*'
+
+struct rule {
+	int action;
+	char *arg;		/* mark text or hook program */
+	char *text;		/* pattern, for the statistics */
+	int len;		/* pattern length */
+	int anchored;		/* only matches at the start of the line */
+	int sink;		/* route target */
+	unsigned long hits;	/* lines that matched */
+	unsigned long lastline;	/* last line counted, to count lines once */
+};
+
+/*
+ * Action names as used in the rules file.
+ */
+static struct ruleact {
+	char *name;
+	int action;
+	int needarg;		/* 1: required, 0: optional, -1: none */
+} ruleacts[] = {
+	{ "sync",   ACT_SYNC,   -1 },
+	{ "mark",   ACT_MARK,    0 },
+	{ "count",  ACT_COUNT,  -1 },
+	{ "hook",   ACT_HOOK,    1 },
+	{ "redact", ACT_REDACT,  0 },
+	{ "urgent", ACT_URGENT, -1 },
+	{ "route",  ACT_ROUTE,   1 },
+	{ "detach", ACT_DETACH, -1 },
+	{ NULL,     0,           0 },
+};
+
+static struct rule *rules;
+static int nrules;
+static struct matcher rulematch;
+static unsigned long linecount;
+static int hooks_running;
+static pid_t hookpids[MAX_HOOKS];	/* 0 for a free slot */
+static unsigned long hooks_skipped;
+static unsigned long redactions;
+
+/*
+ * Where a redact:next was at the end of the last piece.
+ */
+#define NEXT_NONE	0
+#define NEXT_BLANK	1	/* still looking for the word */
+#define NEXT_WORD	2	/* in the middle of it */
+static int redactnext = NEXT_NONE;
+
+/*
+ * The line being scanned, for the redaction rules.
+ */
+struct scanline {
+	struct ruleres *res;
+	unsigned char *line;
+	int len;
+	int cont;		/* not the start of the line */
+};
+
+/*
+ * Start a hook program with the matching line as its argument.
+ * We never wait for it here; rules_reap() collects it later.
+ */
+static void runhook(struct rule *r, unsigned char *line, int len)
+{
+	char arg[LOGLINE_MAX + 1];
+	pid_t pid;
+	int fd, i;
+
+	if (hooks_running >= MAX_HOOKS) {
+		hooks_skipped++;
+		return;
+	}
+	memcpy(arg, line, len);
+	arg[len] = 0;
+
+	if ((pid = fork()) < 0) {
+		hooks_skipped++;
+		return;
+	}
+	if (pid == 0) {
+		/* Don't keep the pty or the logfile open behind our back. */
+		for (fd = 3; fd < 1024; fd++) {
+			close(fd);
+		}
+		rt_undo();
+		setenv("BOOTLOGD_PATTERN", r->text, 1);
+		execl(r->arg, r->arg, arg, (char *)NULL);
+		_exit(127);
+	}
+	for (i = 0; hookpids[i] != 0; i++) {
+		;
+	}
+	hookpids[i] = pid;
+	hooks_running++;
+}
+
+/*
+ * Collect finished hook programs. Only ours: when we run inside init,
+ * the other children are not ours to wait for.
+ */
+void rules_reap(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_HOOKS && hooks_running > 0; i++) {
+		/* -1 too: somebody else got to it first */
+		if (hookpids[i] != 0 && waitpid(hookpids[i], NULL, WNOHANG) != 0) {
+			hookpids[i] = 0;
+			hooks_running--;
+		}
+	}
+}
+
+/*
+ * Mask a match, or with redact:next the word that follows it.
+ */
+static void redact(struct rule *r, struct scanline *sl, size_t end)
+{
+	size_t start;
+
+	if (r->arg) {
+		while (end < (size_t)sl->len && (sl->line[end] == ' ' || sl->line[end] == '\t')) {
+			end++;
+		}
+		start = end;
+		while (end < (size_t)sl->len && sl->line[end] != ' ' && sl->line[end] != '\t') {
+			end++;
+		}
+		if (end == (size_t)sl->len) {
+			redactnext = start == end ? NEXT_BLANK : NEXT_WORD;
+		}
+	}
+	else {
+		start = end - r->len;
+	}
+	if (end > start) {
+		memset(sl->line + start, REDACT_CHAR, end - start);
+		redactions++;
+	}
+}
+
+static int rulematched(int id, size_t end, void *arg)
+{
+	struct scanline *sl = arg;
+	struct ruleres *res = sl->res;
+	struct rule *r = &rules[id];
+
+	/* a piece after the first, or the tail held back, has no start */
+	if (r->anchored && (sl->cont || end != (size_t)r->len)) {
+		return 0;
+	}
+	/* Every occurrence needs masking, not just the first. */
+	if (r->action == ACT_REDACT) {
+		redact(r, sl, end);
+	}
+	if (r->lastline == linecount) {
+		return 0;
+	}
+	r->lastline = linecount;
+	r->hits++;
+	res->flags |= r->action;
+	if (r->action == ACT_ROUTE) {
+		res->route |= 1U << r->sink;
+	}
+	if (r->action == ACT_MARK && res->mark == NULL) {
+		res->mark = r->arg ? r->arg : r->text;
+	}
+
+	return 0;
+}
+
+/*
+ * Mask what a redact:next left unfinished at the end of the last
+ * piece of the line.
+ */
+static void redactcont(unsigned char *line, int len)
+{
+	int start = 0, end = 0;
+
+	if (redactnext == NEXT_BLANK) {
+		while (end < len && (line[end] == ' ' || line[end] == '\t')) {
+			end++;
+		}
+		start = end;
+	}
+	while (end < len && line[end] != ' ' && line[end] != '\t') {
+		end++;
+	}
+	if (end > start) {
+		memset(line + start, REDACT_CHAR, end - start);
+		if (redactnext == NEXT_BLANK) {
+			redactions++;
+		}
+	}
+	redactnext = end < len ? NEXT_NONE : start == end ? NEXT_BLANK : NEXT_WORD;
+}
+
+/*
+ * Scan one assembled line, or a piece of one (cont is set for all
+ * pieces but the first), and carry out the actions that do not need
+ * the logfile; the rest is left to the caller through res.
+ */
+void rules_line(unsigned char *line, int len, int cont, struct ruleres *res)
+{
+	struct scanline sl;
+	int i;
+
+	res->flags = 0;
+	res->mark = NULL;
+	res->route = 0;
+	if (nrules == 0) {
+		return;
+	}
+	if (!cont) {
+		redactnext = NEXT_NONE;
+	}
+	else if (redactnext != NEXT_NONE) {
+		redactcont(line, len);
+	}
+	linecount++;
+	sl.res = res;
+	sl.line = line;
+	sl.len = len;
+	sl.cont = cont;
+	if (match_scan(&rulematch, line, len, rulematched, &sl) == 0) {
+		return;
+	}
+	if (res->flags & ACT_HOOK) {
+		for (i = 0; i < nrules; i++) {
+			if (rules[i].action == ACT_HOOK && rules[i].lastline == linecount) {
+				runhook(&rules[i], line, len);
+			}
+		}
+	}
+}
+
+/*
+ * How many bytes at the end of a piece of a line to hold back for
+ * the next piece, because a pattern could start there.
+ */
+int rules_tail(unsigned char *line, int len)
+{
+	return nrules ? match_tail(&rulematch, line, len) : 0;
+}
+
+/*
+ * Undo the escapes in a pattern, in place. Returns the new length.
+ */
+static int unescape(char *s)
+{
+	char *p, *q;
+
+	for (p = q = s; *p; p++) {
+		if (*p == '\\' && p[1]) {
+			p++;
+			switch (*p) {
+				case 's':
+					*q++ = ' ';
+					break;
+				case 't':
+					*q++ = '\t';
+					break;
+				default:
+					*q++ = *p;
+					break;
+			}
+			continue;
+		}
+		*q++ = *p;
+	}
+	*q = 0;
+
+	return q - s;
+}
+
+/*
+ * Read a rules file. There can be more than one; the patterns of
+ * all of them are compiled together by rules_bind().
+ */
+int rules_load(const char *file)
+{
+	FILE *fp;
+	char buf[LOGLINE_MAX];
+	char *p, *name, *arg, *pat;
+	struct ruleact *a;
+	struct rule *r;
+	int lineno = 0;
+	int anchored;
+	int len;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		fprintf(stderr, "bootlogd: %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		lineno++;
+		buf[strcspn(buf, "\r\n")] = 0;
+		for (p = buf; isspace((unsigned char)*p); p++)
+			;
+		if (*p == 0 || *p == '#') {
+			continue;
+		}
+
+		name = p;
+		while (*p && !isspace((unsigned char)*p)) {
+			p++;
+		}
+		if (*p) {
+			*p++ = 0;
+		}
+		while (isspace((unsigned char)*p)) {
+			p++;
+		}
+		pat = p;
+		if ((anchored = (*pat == '^')) != 0) {
+			pat++;
+		}
+		if ((arg = strchr(name, ':')) != NULL) {
+			*arg++ = 0;
+		}
+
+		for (a = ruleacts; a->name; a++) {
+			if (strcmp(a->name, name) == 0) {
+				break;
+			}
+		}
+		if (a->name == NULL) {
+			fprintf(stderr, "bootlogd: %s:%d: unknown action \"%s\"\n", file, lineno, name);
+			goto err;
+		}
+		if ((a->needarg > 0 && (arg == NULL || *arg == 0)) || (a->needarg < 0 && arg) ||
+				(a->action == ACT_REDACT && arg && strcmp(arg, "next") != 0)) {
+			fprintf(stderr, "bootlogd: %s:%d: bad argument for \"%s\"\n", file, lineno, name);
+			goto err;
+		}
+		if ((len = unescape(pat)) == 0) {
+			fprintf(stderr, "bootlogd: %s:%d: missing pattern\n", file, lineno);
+			goto err;
+		}
+
+		r = realloc(rules, (nrules + 1) * sizeof(*rules));
+		if (r == NULL) {
+			goto oom;
+		}
+		rules = r;
+		r = &rules[nrules];
+		memset(r, 0, sizeof(*r));
+		r->action = a->action;
+		r->arg = (arg && *arg) ? strdup(arg) : NULL;
+		r->text = strdup(pat);
+		r->len = len;
+		r->anchored = anchored;
+		if (r->text == NULL || match_add(&rulematch, pat, len) != nrules) {
+			goto oom;
+		}
+		nrules++;
+	}
+	fclose(fp);
+
+	return nrules;
+oom:
+	fprintf(stderr, "bootlogd: %s: out of memory\n", file);
+err:
+	fclose(fp);
+
+	return -1;
+}
+
+/*
+ * Once all rules files are read and all outputs are known: compile
+ * the patterns and look up the outputs named by route rules.
+ */
+int rules_bind(void)
+{
+	int i;
+
+	if (nrules && match_compile(&rulematch) < 0) {
+		fprintf(stderr, "bootlogd: rules: out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < nrules; i++) {
+		if (rules[i].action != ACT_ROUTE) {
+			continue;
+		}
+		if ((rules[i].sink = sink_find(rules[i].arg)) < 0) {
+			fprintf(stderr, "bootlogd: route to unknown output \"%s\"\n", rules[i].arg);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Dump the rule counters.
+ */
+void rules_stats(FILE *fp)
+{
+	struct ruleact *a;
+	int i;
+
+	for (i = 0; i < nrules; i++) {
+		for (a = ruleacts; a->action != rules[i].action; a++)
+			;
+		fprintf(fp, "rule %s \"%s\" %lu\n", a->name, rules[i].text, rules[i].hits);
+	}
+	if (nrules) {
+		fprintf(fp, "hooks_skipped %lu\n", hooks_skipped);
+		fprintf(fp, "redactions %lu\n", redactions);
+	}
+}
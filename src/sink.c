@@ -0,0 +1,747 @@
+/*
+ * sink.c	Writing captured lines out to the logfiles.
+ *
+ *		Sink 0 is the main logfile (-l). More can be given with -o;
+ *		each line is routed to the sinks whose priority filter it
+ *		passes, plus the ones picked by route rules. The routing is
+ *		decided once, when the line is assembled, and stored in the
+ *		record as a bit mask.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "bootlogd.h"
+
+struct sink sinks[MAX_SINKS];
+int nsinks = 0;
+int boottime = 0;	/* a sink wants CLOCK_BOOTTIME stamps */
+
+/*
+ * With a real-time priority (-R), the capture loop does not
+ * fdatasync() itself: that can take as long as the disk likes. A
+ * child at normal priority does it, and while one runs, the sinks
+ * that want syncing again are only noted. How often to look for the
+ * child to be done, in msecs, when they are.
+ */
+#define SYNC_MS		10
+
+static pid_t syncpid = -1;
+static unsigned int syncwant;	/* sinks to sync next, a bit each */
+
+struct sink *sink_add(char *name, char *path)
+{
+	struct sink *s;
+
+	if (nsinks == MAX_SINKS) {
+		fmt_fd(2, "bootlogd: too many outputs\n");
+		return NULL;
+	}
+	s = &sinks[nsinks++];
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->path = path;
+	s->maxprio = -1;
+	s->fd = -1;
+	ring_cursor(&s->cur);
+
+	return s;
+}
+
+#ifndef TINY
+/*
+ * Outputs that are not files: name=kind:where.
+ */
+static struct sinkkind {
+	char *kind;
+	int (*setup)(struct sink *s, char *where);
+} sinkkinds[] = {
+	{ "syslog",  syslog_setup  },
+	{ "journal", journal_setup },
+	{ "tcp",     fwd_tcp       },
+	{ "udp",     fwd_udp       },
+	{ "unix",    fwd_unix      },
+	{ "spool",   spool_setup   },
+	{ NULL,      NULL          },
+};
+
+/*
+ * Parse an output given as name=path[,option...] or
+ * name=kind[:where][,option...].
+ */
+int sink_parse(char *spec)
+{
+	struct sinkkind *k;
+	struct sink *s;
+	char *path, *opt, *next;
+	int n;
+
+	if ((spec = strdup(spec)) == NULL || (path = strchr(spec, '=')) == NULL || path == spec) {
+		fprintf(stderr, "bootlogd: bad output \"%s\"\n", spec);
+		return -1;
+	}
+	*path++ = 0;
+	if ((opt = strchr(path, ',')) != NULL) {
+		*opt++ = 0;
+	}
+	if (*path == 0 || sink_find(spec) >= 0) {
+		fprintf(stderr, "bootlogd: bad output \"%s\"\n", spec);
+		return -1;
+	}
+	if ((s = sink_add(spec, path)) == NULL) {
+		return -1;
+	}
+	for (k = sinkkinds; k->kind; k++) {
+		n = strlen(k->kind);
+		if (strncmp(path, k->kind, n) == 0 && (path[n] == 0 || path[n] == ':')) {
+			if (k->setup(s, path[n] ? path + n + 1 : path + n) < 0) {
+				return -1;
+			}
+			break;
+		}
+	}
+
+	for (; opt; opt = next) {
+		if ((next = strchr(opt, ',')) != NULL) {
+			*next++ = 0;
+		}
+		if (strcmp(opt, "all") == 0) {
+			s->all = 1;
+		}
+		else if (strcmp(opt, "sync") == 0) {
+			s->sync = 1;
+		}
+		else if (strcmp(opt, "json") == 0 && s->pump == NULL) {
+			s->json = 1;
+			boottime = 1;
+		}
+		else if (strncmp(opt, "prio=", 5) == 0 && opt[5] >= '0' && opt[5] <= '7' && opt[6] == 0) {
+			s->maxprio = opt[5] - '0';
+		}
+		else if (s->pump == syslog_pump && strncmp(opt, "facility=", 9) == 0 &&
+				syslog_facility(opt + 9) >= 0) {
+			s->facility = syslog_facility(opt + 9);
+		}
+		else if ((s->pump == syslog_pump || s->pump == journal_pump) &&
+				strncmp(opt, "tag=", 4) == 0 && opt[4] && strlen(opt + 4) <= TAG_MAX) {
+			s->tag = opt + 4;
+		}
+		else if (s->pump == syslog_pump && strcmp(opt, "rfc5424") == 0) {
+			s->rfc5424 = 1;
+		}
+		else if (s->spool == NULL || spool_option(s, opt) < 0) {
+			fprintf(stderr, "bootlogd: %s: unknown option \"%s\"\n", s->name, opt);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+#endif
+
+int sink_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nsinks; i++) {
+		if (strcmp(sinks[i].name, name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * The sinks a line goes to, before any route rules.
+ */
+unsigned int sink_route(int prio)
+{
+	unsigned int route = 0;
+	int i;
+
+	for (i = 0; i < nsinks; i++) {
+		if (sinks[i].all || (prio >= 0 && prio <= sinks[i].maxprio)) {
+			route |= 1U << i;
+		}
+	}
+
+	return route;
+}
+
+#ifndef TINY
+/*
+ * A logfile is a stdio stream.
+ */
+#define out_isopen(s)	((s)->fp != NULL)
+#define out_fd(s)	fileno((s)->fp)
+
+static int out_attach(struct sink *s, int fd)
+{
+	s->fp = fdopen(fd, "w");
+
+	return s->fp ? 0 : -1;
+}
+
+static int out_open(struct sink *s, const char *path)
+{
+	s->fp = fopen(path, "a");
+
+	return s->fp ? 0 : -1;
+}
+
+static void out_put(struct sink *s, const char *p, int n)
+{
+	fwrite(p, sizeof(char), n, s->fp);
+}
+
+static int out_flush(struct sink *s)
+{
+	return fflush(s->fp);
+}
+
+static void out_close(struct sink *s)
+{
+	fclose(s->fp);
+	s->fp = NULL;
+}
+
+/*
+ * The date in front of a line: "Thu Oct 17 04:21:23 2026: ".
+ */
+static void out_stamp(char *buf, time_t t)
+{
+	snprintf(buf, 27, "%.24s: ", ctime(&t));
+}
+#else
+/*
+ * In the small build, a logfile is an fd with a buffer of our own
+ * in front of it, and the dates are in UTC: working out the local
+ * time would take the stdio of the C library along.
+ */
+#define OUTBUF		8192
+
+#define out_isopen(s)	((s)->obuf != NULL)
+#define out_fd(s)	((s)->lfd)
+
+static int out_attach(struct sink *s, int fd)
+{
+	if ((s->obuf = malloc(OUTBUF)) == NULL) {
+		return -1;
+	}
+	s->lfd = fd;
+	s->olen = 0;
+
+	return 0;
+}
+
+static int out_open(struct sink *s, const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0666)) < 0) {
+		return -1;
+	}
+	if (out_attach(s, fd) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int out_flush(struct sink *s)
+{
+	int n, done;
+
+	for (done = 0; done < s->olen; done += n) {
+		if ((n = write(s->lfd, s->obuf + done, s->olen - done)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			/* like stdio, we do not keep what the file would not take */
+			s->olen = 0;
+			return -1;
+		}
+	}
+	s->olen = 0;
+
+	return 0;
+}
+
+static void out_put(struct sink *s, const char *p, int n)
+{
+	int m;
+
+	while (n > 0) {
+		if (s->olen == OUTBUF) {
+			out_flush(s);
+		}
+		m = OUTBUF - s->olen < n ? OUTBUF - s->olen : n;
+		memcpy(s->obuf + s->olen, p, m);
+		s->olen += m;
+		p += m;
+		n -= m;
+	}
+}
+
+static void out_close(struct sink *s)
+{
+	out_flush(s);
+	close(s->lfd);
+	free(s->obuf);
+	s->obuf = NULL;
+}
+
+static void put2(char *p, int v)
+{
+	p[0] = '0' + v / 10;
+	p[1] = '0' + v % 10;
+}
+
+/*
+ * The date in front of a line, as ctime() has it, but in UTC.
+ */
+static void out_stamp(char *buf, time_t t)
+{
+	static const char days[] = "ThuFriSatSunMonTueWed";
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	long z, era, doe, yoe, doy, mp, d, m, y, secs;
+
+	z = t / 86400;
+	secs = t % 86400;
+	if (secs < 0) {
+		secs += 86400;
+		z--;
+	}
+	memcpy(buf, days + ((z % 7 + 7) % 7) * 3, 3);
+
+	/* days since 1970 to a civil date, from Howard Hinnant */
+	z += 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y = yoe + era * 400 + (m <= 2);
+
+	buf[3] = ' ';
+	memcpy(buf + 4, months + (m - 1) * 3, 3);
+	buf[7] = ' ';
+	put2(buf + 8, d);
+	if (d < 10) {
+		buf[8] = ' ';
+	}
+	buf[10] = ' ';
+	put2(buf + 11, secs / 3600);
+	buf[13] = ':';
+	put2(buf + 14, secs / 60 % 60);
+	buf[16] = ':';
+	put2(buf + 17, secs % 60);
+	buf[19] = ' ';
+	put2(buf + 20, y / 100 % 100);
+	put2(buf + 22, y % 100);
+	buf[24] = ':';
+	buf[25] = ' ';
+	buf[26] = 0;
+}
+#endif
+
+/*
+ * Perhaps we need to open the logfile.
+ */
+static void sink_open(struct sink *s)
+{
+	char buf[1024];
+
+	if (access(s->path, F_OK) == 0) {
+		if (s->rotate) {
+			fmt_buf(buf, sizeof(buf), "%s~", s->path);
+			rename(s->path, buf);
+		}
+		out_open(s, s->path);
+	}
+	if (!out_isopen(s) && createlogfile) {
+		out_open(s, s->path);
+	}
+}
+
+/*
+ * Write one record the way the logfiles have it. The collector
+ * (collect.c) writes its per-host logs with this as well.
+ */
+void sink_write(struct sink *s, struct logrec *rec)
+{
+	static char stamp[27];
+	static time_t stamped = -1;
+
+#ifndef TINY
+	if (s->json) {
+		json_write(s, rec);
+		return;
+	}
+#endif
+
+	/* something else got in between the pieces of a line */
+	if (s->partial && !(rec->flags & REC_CONT)) {
+		out_put(s, "\n", 1);
+	}
+	/* prepend date to every line, made once a second */
+	if (!(rec->flags & REC_CONT) || !s->partial) {
+		if (rec->time.tv_sec != stamped) {
+			out_stamp(stamp, rec->time.tv_sec);
+			stamped = rec->time.tv_sec;
+		}
+		out_put(s, stamp, 26);
+	}
+	out_put(s, REC_TEXT(rec), rec->len);
+	if (rec->flags & REC_NL) {
+		out_put(s, "\n", 1);
+	}
+	s->partial = !(rec->flags & REC_NL);
+	s->lines++;
+}
+
+static void syncsinks(unsigned int mask)
+{
+	int i;
+
+	for (i = 0; i < nsinks; i++) {
+		if ((mask & (1U << i)) && out_isopen(&sinks[i])) {
+			fdatasync(out_fd(&sinks[i]));
+		}
+	}
+}
+
+/*
+ * Collect the sync child when it is done (wait for it if wait is
+ * set), and start the next one if a sink is waiting.
+ */
+static void sync_reap(int wait)
+{
+	pid_t pid;
+
+	if (syncpid > 0 && waitpid(syncpid, NULL, wait ? 0 : WNOHANG) != 0) {
+		syncpid = -1;
+	}
+	if (syncpid > 0 || syncwant == 0) {
+		return;
+	}
+	if ((pid = fork()) < 0) {
+		/* then we have to do it ourselves */
+		syncsinks(syncwant);
+	}
+	else if (pid == 0) {
+		rt_undo();
+		syncsinks(syncwant);
+		_exit(0);
+	}
+	else {
+		syncpid = pid;
+	}
+	syncwant = 0;
+}
+
+static void sink_flush(struct sink *s, int sync)
+{
+	out_flush(s);
+	if ((s->sync || sync) && rtprio) {
+		syncwant |= 1U << (s - sinks);
+		sync_reap(0);
+	}
+	else if (s->sync || sync) {
+		fdatasync(out_fd(s));
+	}
+	s->flushpending = 0;
+	s->lastflush = mononow();
+}
+
+/*
+ * Write out whatever the sinks have not seen yet. Urgent lines get
+ * flushed and synced right away, the rest waits for the batch window.
+ */
+void sinks_pump(void)
+{
+	struct logrec *rec;
+	struct sink *s;
+	int i, wrote, sync;
+
+	sync_reap(0);
+	for (i = 0; i < nsinks; i++) {
+		s = &sinks[i];
+		if (s->pump) {
+			s->pump(s, i);
+			continue;
+		}
+		if (!out_isopen(s)) {
+			sink_open(s);
+		}
+		if (!out_isopen(s)) {
+			continue;
+		}
+
+		wrote = sync = 0;
+		while ((rec = ring_next(&s->cur)) != NULL) {
+			if (rec->route & (1U << i)) {
+				sink_write(s, rec);
+				wrote = 1;
+				if (rec->flags & (ACT_SYNC|ACT_URGENT)) {
+					sync = 1;
+				}
+			}
+			ring_advance(&s->cur, rec);
+		}
+
+		if (sync || (wrote && s->sync)) {
+			sink_flush(s, 1);
+		}
+		else if (wrote || s->flushpending) {
+			s->flushpending = 1;
+			if (mononow() - s->lastflush >= batchwin) {
+				sink_flush(s, 0);
+			}
+		}
+	}
+}
+
+/*
+ * Milliseconds until a batch window ends or a sink wants to try again,
+ * or -1 if there is nothing to wait for.
+ */
+int sinks_timeout(void)
+{
+	long long now = mononow();
+	long long left;
+	int tmo = -1;
+	int i;
+
+	for (i = 0; i < nsinks; i++) {
+		if (!sinks[i].flushpending) {
+			continue;
+		}
+		if (sinks[i].pump) {
+			/* lines are waiting for the other end */
+			left = sinks[i].retry - now;
+		}
+		else {
+			left = sinks[i].lastflush + batchwin - now;
+		}
+		if (left < 0) {
+			left = 0;
+		}
+		if (tmo < 0 || left < tmo) {
+			tmo = left;
+		}
+	}
+	if (syncwant && (tmo < 0 || tmo > SYNC_MS)) {
+		tmo = SYNC_MS;
+	}
+
+	return tmo;
+}
+
+/*
+ * At exit, sinks whose file never showed up (or whose daemon or
+ * collector never took the lines) write what they still hold to path
+ * instead. A line routed to several of them is written once, and a
+ * line an open logfile has is not written at all: it is only counted
+ * as lost to the sink. Returns the number of lines saved; the ones we
+ * could not save count as lost.
+ */
+unsigned long sinks_fallback(const char *path)
+{
+	struct logrec *rec;
+	struct sink *s;
+	struct sink fb;		/* the fallback is a plain logfile */
+	unsigned int done = 0, stored = 0;
+	unsigned long saved = 0;
+	int i, tried = 0;
+
+	memset(&fb, 0, sizeof(fb));
+	/* what an open logfile has is not saved again */
+	for (i = 0; i < nsinks; i++) {
+		if (sinks[i].pump == NULL && out_isopen(&sinks[i])) {
+			stored |= 1U << i;
+		}
+	}
+	for (i = 0; i < nsinks; i++) {
+		s = &sinks[i];
+		if (out_isopen(s)) {
+			continue;
+		}
+		while ((rec = ring_next(&s->cur)) != NULL) {
+			if ((rec->route & (1U << i)) && (rec->route & stored)) {
+				/* this sink never got it, but the boot log has it */
+				s->cur.lost++;
+			}
+			else if ((rec->route & (1U << i)) && !(rec->route & done)) {
+				if (!tried) {
+					tried = 1;
+					if (path) {
+						out_open(&fb, path);
+					}
+				}
+				if (!out_isopen(&fb)) {
+					s->cur.lost++;
+				}
+				else {
+					sink_write(&fb, rec);
+					s->lines++;
+					saved++;
+				}
+			}
+			ring_advance(&s->cur, rec);
+		}
+		if (fb.partial) {
+			out_put(&fb, "\n", 1);
+			fb.partial = 0;
+		}
+		done |= 1U << i;
+	}
+	if (out_isopen(&fb)) {
+		out_close(&fb);
+	}
+
+	return saved;
+}
+
+/*
+ * Write all the ring holds to path, the way the logfile has it.
+ */
+static int snapshot_write(const char *path)
+{
+	struct logrec *rec;
+	struct sink s;
+	char tmp[1024];
+	off_t off, size;
+	ssize_t n;
+	int fd, out;
+
+	if ((fd = memfd_create("bootlogd-snapshot", 0)) < 0) {
+		return -1;
+	}
+	memset(&s, 0, sizeof(s));
+	if (out_attach(&s, fd) < 0) {
+		return -1;
+	}
+	ring_cursor(&s.cur);
+	while ((rec = ring_next(&s.cur)) != NULL) {
+		sink_write(&s, rec);
+		ring_advance(&s.cur, rec);
+	}
+	if (s.partial) {
+		out_put(&s, "\n", 1);
+	}
+	if (out_flush(&s) != 0) {
+		return -1;
+	}
+	size = lseek(fd, 0, SEEK_CUR);
+
+	fmt_buf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((out = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		return -1;
+	}
+	for (off = 0; off < size; ) {
+		if ((n = sendfile(out, fd, &off, size - off)) <= 0) {
+			close(out);
+			unlink(tmp);
+			return -1;
+		}
+	}
+	if (fsync(out) < 0 || close(out) < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Take a snapshot of the ring into path. fork() gives the child a
+ * frozen copy of the ring, so all the main loop pays for is the fork;
+ * the child puts the text together in a memfd and copies it to a
+ * temporary file in one go, which it then renames into place. The
+ * child forks once more, so nobody has to wait for it.
+ */
+void sink_snapshot(const char *path)
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		fmt_fd(2, "bootlogd: snapshot: fork failed\n");
+		return;
+	}
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+		return;
+	}
+	if (fork() != 0) {
+		_exit(0);
+	}
+	rt_undo();
+	if (snapshot_write(path) < 0) {
+		fmt_fd(2, "bootlogd: snapshot to %s failed\n", path);
+		_exit(1);
+	}
+	_exit(0);
+}
+
+void sinks_close(void)
+{
+	int i;
+
+	/* the last syncs, before the files go */
+	sync_reap(1);
+	syncsinks(syncwant);
+	syncwant = 0;
+
+	for (i = 0; i < nsinks; i++) {
+		if (sinks[i].fd >= 0) {
+			close(sinks[i].fd);
+			sinks[i].fd = -1;
+		}
+		if (sinks[i].close) {
+			sinks[i].close(&sinks[i]);
+			continue;
+		}
+		if (!out_isopen(&sinks[i])) {
+			continue;
+		}
+		if (sinks[i].partial) {
+			out_put(&sinks[i], "\n", 1);
+		}
+		out_close(&sinks[i]);
+	}
+}
+
+#ifndef TINY
+void sinks_stats(FILE *fp)
+{
+	int i;
+
+	for (i = 0; i < nsinks; i++) {
+		fprintf(fp, "sink %s lines %lu lost %lu\n",
+				sinks[i].name, sinks[i].lines, sinks[i].cur.lost);
+	}
+}
+#endif
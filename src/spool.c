@@ -0,0 +1,321 @@
+/*
+ * spool.c	A spool of finished chunks (-o name=spool:dir).
+ *
+ *		For log shippers that would rather not tail a file that is
+ *		still being written. Lines are written, the way the logfile
+ *		has them, to a chunk in dir/tmp; once the chunk is big
+ *		enough (size=) or old enough (secs=) it is closed and
+ *		renamed into dir/new, as in a maildir. Whatever is in new
+ *		is complete and never touched again: a shipper can take it,
+ *		move it or remove it without any locking, and we never wait
+ *		for one.
+ *
+ *		Chunks are numbered so they sort in the order they were
+ *		written. The numbers are kept in dir/seq, taken SPOOL_RESERVE
+ *		at a time as forward.c does: new may have been emptied by
+ *		the shipper when we start again, and numbering from 0 would
+ *		make the new chunks sort before the old ones.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bootlogd.h"
+
+#define SPOOL_SIZE	(256 * 1024)	/* default size of a chunk */
+#define SPOOL_SECS	10		/* default age of a chunk */
+#define SPOOL_RETRY	1000		/* msecs between looks for the directory */
+#define SPOOL_STAMP	26		/* "Thu Jan  1 00:00:00 1970: " */
+#define SPOOL_RESERVE	1000		/* chunk numbers taken at a time */
+
+struct spool {
+	unsigned long seq;		/* number of the next chunk */
+	unsigned long reserved;		/* numbers below this may have been used */
+	int ready;			/* tmp and new are there */
+	int sealed;			/* the chunk is closed but still in tmp */
+	long size;			/* bytes in a chunk */
+	int secs;			/* age of a chunk, 0 for any */
+	long bytes;			/* in the current chunk, about */
+	long long opened;		/* mononow() the chunk was started */
+	char tmp[1024];			/* the current chunk */
+};
+
+static int  spool_pump(struct sink *s, int idx);
+static void spool_close(struct sink *s);
+
+int spool_setup(struct sink *s, char *dir)
+{
+	if (*dir == 0 || (s->spool = calloc(1, sizeof(struct spool))) == NULL) {
+		fprintf(stderr, "bootlogd: %s: bad spool\n", s->name);
+		return -1;
+	}
+	s->path = dir;
+	s->pump = spool_pump;
+	s->close = spool_close;
+	s->spool->size = SPOOL_SIZE;
+	s->spool->secs = SPOOL_SECS;
+
+	return 0;
+}
+
+/*
+ * size=N[k|m] and secs=N. Returns -1 for an option that is not ours.
+ */
+int spool_option(struct sink *s, char *opt)
+{
+	char *end;
+	long n;
+
+	if (strncmp(opt, "secs=", 5) == 0) {
+		n = strtol(opt + 5, &end, 10);
+		if (end == opt + 5 || *end || n < 0) {
+			return -1;
+		}
+		s->spool->secs = n;
+		return 0;
+	}
+	if (strncmp(opt, "size=", 5) != 0) {
+		return -1;
+	}
+	n = strtol(opt + 5, &end, 10);
+	if (*end == 'k' || *end == 'K') {
+		n *= 1024;
+		end++;
+	}
+	else if (*end == 'm' || *end == 'M') {
+		n *= 1024 * 1024;
+		end++;
+	}
+	if (end == opt + 5 || *end || n <= 0) {
+		return -1;
+	}
+	s->spool->size = n;
+
+	return 0;
+}
+
+/*
+ * Take the next SPOOL_RESERVE chunk numbers, and note that on disk
+ * before any of them is used. Returns -1 if it could not be noted;
+ * then none of them are ours.
+ */
+static int spool_reserve(struct sink *s)
+{
+	struct spool *sp = s->spool;
+	char path[1024], tmp[1032];
+	FILE *fp;
+	int bad;
+
+	snprintf(path, sizeof(path), "%s/seq", s->path);
+	snprintf(tmp, sizeof(tmp), "%s~", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		return -1;
+	}
+	bad = fprintf(fp, "%lu\n", sp->seq + SPOOL_RESERVE) < 0;
+	bad |= fflush(fp) != 0 || fdatasync(fileno(fp)) < 0;
+	bad |= fclose(fp) != 0;
+	if (bad || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	sp->reserved = sp->seq + SPOOL_RESERVE;
+
+	return 0;
+}
+
+/*
+ * Once the directory is there, make tmp and new, and find the number
+ * to go on from: above the ones taken before, and above whatever
+ * is still in new.
+ */
+static int spool_ready(struct sink *s)
+{
+	struct spool *sp = s->spool;
+	char path[1024];
+	struct dirent *d;
+	unsigned long n;
+	FILE *fp;
+	DIR *dir;
+
+	if (access(s->path, F_OK) < 0 && (!createlogfile || mkdir(s->path, 0755) < 0)) {
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/tmp", s->path);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/new", s->path);
+	mkdir(path, 0755);
+	if ((dir = opendir(path)) == NULL) {
+		return -1;
+	}
+	while ((d = readdir(dir)) != NULL) {
+		if (sscanf(d->d_name, "%lu", &n) == 1 && n >= sp->seq) {
+			sp->seq = n + 1;
+		}
+	}
+	closedir(dir);
+	snprintf(path, sizeof(path), "%s/seq", s->path);
+	if ((fp = fopen(path, "r")) != NULL) {
+		if (fscanf(fp, "%lu", &n) == 1 && n > sp->seq) {
+			sp->seq = n;
+		}
+		fclose(fp);
+	}
+	if (spool_reserve(s) < 0) {
+		return -1;
+	}
+	sp->ready = 1;
+
+	return 0;
+}
+
+/*
+ * Start the next chunk. A chunk some earlier bootlogd (with our pid)
+ * left in tmp is not ours to write over: its number is skipped.
+ */
+static int spool_open(struct sink *s)
+{
+	struct spool *sp = s->spool;
+	int fd;
+
+	for (;;) {
+		if (sp->seq >= sp->reserved && spool_reserve(s) < 0) {
+			return -1;
+		}
+		snprintf(sp->tmp, sizeof(sp->tmp), "%s/tmp/%010lu.%d", s->path, sp->seq, (int)getpid());
+		if ((fd = open(sp->tmp, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644)) >= 0) {
+			break;
+		}
+		if (errno != EEXIST) {
+			return -1;
+		}
+		sp->seq++;
+	}
+	if ((s->fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(sp->tmp);
+		return -1;
+	}
+	sp->bytes = 0;
+	sp->opened = mononow();
+
+	return 0;
+}
+
+/*
+ * Move the closed chunk into new. Until that works, it stays in tmp
+ * under its number, and no other chunk is started: returns -1 then.
+ */
+static int spool_move(struct sink *s)
+{
+	struct spool *sp = s->spool;
+	char path[1024];
+
+	snprintf(path, sizeof(path), "%s/new/%010lu", s->path, sp->seq);
+	if (rename(sp->tmp, path) < 0) {
+		sp->sealed = 1;
+		return -1;
+	}
+	sp->sealed = 0;
+	sp->seq++;
+
+	return 0;
+}
+
+/*
+ * Finish the chunk, and move it into new. Whatever could not be
+ * written still goes along with the rest of it.
+ */
+static int spool_seal(struct sink *s)
+{
+	if (s->partial) {
+		fputc('\n', s->fp);
+		s->partial = 0;
+	}
+	fflush(s->fp);
+	if (s->sync) {
+		fdatasync(fileno(s->fp));
+	}
+	fclose(s->fp);
+	s->fp = NULL;
+
+	return spool_move(s);
+}
+
+static int spool_pump(struct sink *s, int idx)
+{
+	struct spool *sp = s->spool;
+	struct logrec *rec;
+	struct ringcur cur;
+	long long now = mononow();
+
+	if (!sp->ready && (now < s->retry || spool_ready(s) < 0)) {
+		if (now >= s->retry) {
+			s->retry = now + SPOOL_RETRY;
+		}
+		cur = s->cur;
+		s->flushpending = ring_next(&cur) != NULL;
+		return 0;
+	}
+	if (sp->sealed && (now < s->retry || spool_move(s) < 0)) {
+		s->flushpending = 1;
+		if (now >= s->retry) {
+			s->retry = now + SPOOL_RETRY;
+		}
+		return 0;
+	}
+
+	while ((rec = ring_next(&s->cur)) != NULL) {
+		if (rec->route & (1U << idx)) {
+			if (s->fp == NULL && spool_open(s) < 0) {
+				s->flushpending = 1;
+				s->retry = now + SPOOL_RETRY;
+				return 0;
+			}
+			sink_write(s, rec);
+			sp->bytes += SPOOL_STAMP + rec->len + 1;
+		}
+		ring_advance(&s->cur, rec);
+		/* only between lines, if we can help it */
+		if (s->fp && sp->bytes >= sp->size && (!s->partial || sp->bytes >= 2 * sp->size) &&
+				spool_seal(s) < 0) {
+			s->flushpending = 1;
+			s->retry = now + SPOOL_RETRY;
+			return 0;
+		}
+	}
+	if (s->fp && sp->secs && now - sp->opened >= sp->secs * 1000LL && spool_seal(s) < 0) {
+		s->flushpending = 1;
+		s->retry = now + SPOOL_RETRY;
+		return 0;
+	}
+
+	/* come back when the chunk is old enough */
+	s->flushpending = s->fp != NULL && sp->secs;
+	s->retry = sp->opened + sp->secs * 1000LL;
+
+	return 0;
+}
+
+static void spool_close(struct sink *s)
+{
+	if (s->fp) {
+		spool_seal(s);
+	}
+	else if (s->spool->sealed) {
+		spool_move(s);
+	}
+}
@@ -0,0 +1,228 @@
+/*
+ * syslog.c	Forwarding lines to a syslog daemon (-o name=syslog:path).
+ *
+ *		Lines are sent as datagrams to /dev/log (or another unix
+ *		socket), in the RFC 3164 format syslog daemons all take, or
+ *		in RFC 5424 with the rfc5424 option. They carry the time the
+ *		line came in, not the time we got around to sending it.
+ *
+ *		We send in batches with sendmmsg(), the text straight out of
+ *		the ring. The cursor only moves past what the socket took,
+ *		so until a syslog daemon shows up (or while it cannot keep
+ *		up) the lines wait in the ring like they do for a logfile
+ *		that is not there yet.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include "bootlogd.h"
+
+#define SYSLOG_PATH	"/dev/log"
+#define SYSLOG_BATCH	32	/* messages per sendmmsg() */
+#define SYSLOG_HDR	320	/* room for the header of one message */
+#define SYSLOG_RETRY	1000	/* msecs between connection attempts */
+#define SYSLOG_BACKOFF	20	/* msecs to wait when the socket is full */
+
+static struct facility {
+	char *name;
+	int code;
+} facilities[] = {
+	{ "kern",   0 },  { "user",   1 },  { "daemon", 3 },  { "auth",   4 },
+	{ "syslog", 5 },  { "local0", 16 }, { "local1", 17 }, { "local2", 18 },
+	{ "local3", 19 }, { "local4", 20 }, { "local5", 21 }, { "local6", 22 },
+	{ "local7", 23 }, { NULL,     0 },
+};
+
+static char hostname[256] = "-";
+
+/*
+ * Facility by name, or -1.
+ */
+int syslog_facility(const char *name)
+{
+	struct facility *f;
+
+	for (f = facilities; f->name; f++) {
+		if (strcmp(f->name, name) == 0) {
+			return f->code;
+		}
+	}
+
+	return -1;
+}
+
+int syslog_setup(struct sink *s, char *path)
+{
+	s->path = *path ? path : SYSLOG_PATH;
+	s->pump = syslog_pump;
+	s->facility = 3;
+	s->tag = "bootlogd";
+
+	return 0;
+}
+
+static int syslog_connect(struct sink *s)
+{
+	struct sockaddr_un sun;
+	long long now = mononow();
+
+	if (now < s->retry) {
+		return -1;
+	}
+	s->retry = now + SYSLOG_RETRY;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, s->path, sizeof(sun.sun_path) - 1);
+	if ((s->fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0)) < 0) {
+		return -1;
+	}
+	if (connect(s->fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(s->fd);
+		s->fd = -1;
+		return -1;
+	}
+	/* it may have been set by now */
+	if (gethostname(hostname, sizeof(hostname)) < 0 || hostname[0] == 0) {
+		strcpy(hostname, "-");
+	}
+	hostname[sizeof(hostname) - 1] = 0;
+
+	return 0;
+}
+
+/*
+ * The header of a message: priority, time, host and tag. Returns its
+ * length in hdr, which is cut at SYSLOG_HDR - 1 bytes if need be.
+ */
+static int syslog_header(struct sink *s, struct logrec *rec, char *hdr)
+{
+	struct tm *tm;
+	char date[64];
+	int sev, n;
+
+	sev = rec->prio >= 0 ? rec->prio : 6;
+	if (s->rfc5424) {
+		tm = gmtime(&rec->time.tv_sec);
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", tm);
+		n = snprintf(hdr, SYSLOG_HDR, "<%d>1 %s.%06ldZ %s %s - - - ",
+				s->facility * 8 + sev, date, rec->time.tv_nsec / 1000,
+				hostname, s->tag);
+	}
+	else {
+		tm = localtime(&rec->time.tv_sec);
+		strftime(date, sizeof(date), "%b %e %H:%M:%S", tm);
+		n = snprintf(hdr, SYSLOG_HDR, "<%d>%s %s: ", s->facility * 8 + sev, date, s->tag);
+	}
+	if (n < 0) {
+		n = 0;
+	}
+
+	return n < SYSLOG_HDR ? n : SYSLOG_HDR - 1;
+}
+
+/*
+ * Send what we can of what the sink has not seen yet.
+ */
+int syslog_pump(struct sink *s, int idx)
+{
+	static char hdr[SYSLOG_BATCH][SYSLOG_HDR];
+	struct iovec iov[SYSLOG_BATCH][2];
+	struct mmsghdr msg[SYSLOG_BATCH];
+	struct ringcur cur;
+	struct logrec *rec;
+	char *text;
+	int n, k, sent, len, toobig;
+
+	/* until we are done, the main loop comes back at s->retry */
+	s->flushpending = 1;
+	if (s->fd < 0 && syslog_connect(s) < 0) {
+		cur = s->cur;
+		s->flushpending = ring_next(&cur) != NULL;
+		return 0;
+	}
+
+	for (;;) {
+		/*
+		 * Gather a batch, without moving the cursor yet.
+		 */
+		cur = s->cur;
+		n = toobig = 0;
+		while (n < SYSLOG_BATCH && (rec = ring_next(&cur)) != NULL) {
+			if ((rec->route & (1U << idx)) && rec->len > 0) {
+				text = REC_TEXT(rec);
+				len = rec->len;
+				/* the priority is in the header */
+				if (rec->prio >= 0 && !(rec->flags & REC_CONT) && len >= 3) {
+					text += 3;
+					len -= 3;
+				}
+				iov[n][0].iov_base = hdr[n];
+				iov[n][0].iov_len = syslog_header(s, rec, hdr[n]);
+				iov[n][1].iov_base = text;
+				iov[n][1].iov_len = len;
+				memset(&msg[n], 0, sizeof(msg[n]));
+				msg[n].msg_hdr.msg_iov = iov[n];
+				msg[n].msg_hdr.msg_iovlen = 2;
+				n++;
+			}
+			ring_advance(&cur, rec);
+		}
+		if (n == 0) {
+			/* nothing (more) for us in there */
+			s->cur = cur;
+			s->flushpending = 0;
+			return 0;
+		}
+
+		if ((sent = sendmmsg(s->fd, msg, n, MSG_DONTWAIT)) < 0) {
+			if (errno == EAGAIN || errno == EINTR || errno == ENOBUFS) {
+				s->retry = mononow() + SYSLOG_BACKOFF;
+				return 0;
+			}
+			if (errno != EMSGSIZE) {
+				/* the daemon went away, we will be back */
+				close(s->fd);
+				s->fd = -1;
+				return 0;
+			}
+			/* this one will never fit: skip it */
+			s->cur.lost++;
+			toobig = 1;
+			sent = 1;
+		}
+		else {
+			s->lines += sent;
+		}
+
+		/*
+		 * Move the cursor past what was sent.
+		 */
+		for (k = sent; k > 0 && (rec = ring_next(&s->cur)) != NULL; ) {
+			if ((rec->route & (1U << idx)) && rec->len > 0) {
+				k--;
+			}
+			ring_advance(&s->cur, rec);
+		}
+		if (sent < n && !toobig) {
+			/* the socket is full */
+			s->retry = mononow() + SYSLOG_BACKOFF;
+			return 0;
+		}
+	}
+}
@@ -0,0 +1,355 @@
+/*
+ * templates.c	Compare this boot with the ones before it (-M).
+ *
+ *		Every line is boiled down to a template: numbers (decimal
+ *		or hex) become "#" and paths become "/...", so "sda1: 2048
+ *		sectors" and "sdb1: 4096 sectors" are the same message. For
+ *		each template we keep when it was first seen (msecs since
+ *		the kernel started) and how often, in a hash table of fixed
+ *		size. Nothing but the hash and the start of the template is
+ *		kept, and all of it is done as the lines come in.
+ *
+ *		At exit the table goes to a small summary file, boot.0 in
+ *		the -M directory; the summaries of earlier boots move up to
+ *		boot.1, boot.2 and so on, up to the number kept (-K). Before
+ *		that, we compare with them and write what stands out to
+ *		"report": templates that showed up much later than usual,
+ *		error messages never seen before, and messages that were
+ *		there in every earlier boot but not in this one.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bootlogd.h"
+
+#define TPL_SLOTS	2048	/* power of two */
+#define TPL_MAX		(TPL_SLOTS / 4 * 3)
+#define TPL_TEXT	64
+#define TPL_BOOTS	32	/* most earlier boots we look at */
+
+/*
+ * How much later than usual counts as late: the usual time plus a
+ * quarter, and at least TPL_LATE msecs.
+ */
+#define TPL_LATE	1000
+
+struct template {
+	unsigned long long hash;	/* 0 for a free slot */
+	long long first;		/* msecs since boot */
+	unsigned long count;
+	int error;			/* looks like an error message */
+	int seen;			/* in an earlier boot, while comparing */
+	char text[TPL_TEXT];
+};
+
+/*
+ * A template from an earlier boot.
+ */
+struct oldtpl {
+	unsigned long long hash;
+	long long first;
+	int error;
+	char text[TPL_TEXT];
+};
+
+static struct template tpl[TPL_SLOTS];
+static int ntpl = 0;
+static unsigned long tpldropped = 0;
+static const char *tpldir = NULL;
+static int tplkeep = 5;
+
+void tpl_start(const char *dir, int keep)
+{
+	tpldir = dir;
+	if (keep > 0) {
+		tplkeep = keep < TPL_BOOTS ? keep : TPL_BOOTS;
+	}
+}
+
+static int isdig(int c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static int isxdig(int c)
+{
+	return isdig(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/*
+ * Template of a line: the hash of all of it, and the start of the
+ * text in out.
+ */
+static unsigned long long tpl_norm(const char *s, int len, char *out)
+{
+	unsigned long long h = 14695981039346656037ULL;	/* FNV-1a */
+	const char *str;
+	int i, n = 0, c, prev = ' ';
+
+	/* a kernel priority is not part of the message */
+	i = (len >= 3 && s[0] == '<' && isdig(s[1]) && s[2] == '>') ? 3 : 0;
+	while (i < len) {
+		c = (unsigned char)s[i];
+		if (isdig(c)) {
+			if (c == '0' && i + 1 < len && (s[i + 1] == 'x' || s[i + 1] == 'X')) {
+				i += 2;
+			}
+			while (i < len && isxdig(s[i])) {
+				i++;
+			}
+			str = "#";
+		}
+		else if (c == '/' && (prev == ' ' || prev == '=' || prev == '(' ||
+				prev == '\'' || prev == '"')) {
+			while (i < len && s[i] != ' ' && s[i] != '\'' && s[i] != '"' &&
+					s[i] != ')' && s[i] != ',' && s[i] != ':') {
+				i++;
+			}
+			str = "/...";
+		}
+		else {
+			i++;
+			h = (h ^ c) * 1099511628211ULL;
+			if (n < TPL_TEXT - 1) {
+				out[n++] = (c >= ' ' && c != 127) ? c : '?';
+			}
+			prev = c;
+			continue;
+		}
+		for (; *str; str++) {
+			h = (h ^ (unsigned char)*str) * 1099511628211ULL;
+			if (n < TPL_TEXT - 1) {
+				out[n++] = *str;
+			}
+		}
+		prev = 'x';
+	}
+	out[n] = 0;
+
+	return h ? h : 1;
+}
+
+static int tpl_iserror(const char *s, int len, int prio)
+{
+	if (prio >= 0 && prio <= 3) {
+		return 1;
+	}
+
+	return memmem(s, len, "error", 5) || memmem(s, len, "Error", 5) ||
+		memmem(s, len, "ERROR", 5) || memmem(s, len, "fail", 4) ||
+		memmem(s, len, "Fail", 4) || memmem(s, len, "FAIL", 4);
+}
+
+static struct template *tpl_find(unsigned long long hash)
+{
+	unsigned int i = hash & (TPL_SLOTS - 1);
+
+	while (tpl[i].hash && tpl[i].hash != hash) {
+		i = (i + 1) & (TPL_SLOTS - 1);
+	}
+
+	return &tpl[i];
+}
+
+/*
+ * A line began at now (msecs since boot).
+ */
+void tpl_line(const char *s, int len, int prio, long long now)
+{
+	char text[TPL_TEXT];
+	unsigned long long hash;
+	struct template *t;
+
+	if (tpldir == NULL) {
+		return;
+	}
+	hash = tpl_norm(s, len, text);
+	t = tpl_find(hash);
+	if (t->hash == 0) {
+		if (ntpl == TPL_MAX) {
+			tpldropped++;
+			return;
+		}
+		ntpl++;
+		t->hash = hash;
+		t->first = now;
+		t->error = tpl_iserror(s, len, prio);
+		strcpy(t->text, text);
+	}
+	t->count++;
+}
+
+static int byhash(const void *a, const void *b)
+{
+	const struct oldtpl *oa = a, *ob = b;
+
+	return oa->hash < ob->hash ? -1 : oa->hash > ob->hash;
+}
+
+static int bytime(const void *a, const void *b)
+{
+	const long long *la = a, *lb = b;
+
+	return *la < *lb ? -1 : *la > *lb;
+}
+
+/*
+ * Read the summaries of the earlier boots. Returns how many there were.
+ */
+static int tpl_load(struct oldtpl **old, int *nold)
+{
+	char path[1024], line[256];
+	struct oldtpl *o;
+	FILE *fp;
+	int b, n = 0, size = 0, nboots = 0;
+
+	*old = NULL;
+	for (b = 0; b < tplkeep; b++) {
+		snprintf(path, sizeof(path), "%s/boot.%d", tpldir, b);
+		if ((fp = fopen(path, "r")) == NULL) {
+			break;
+		}
+		nboots++;
+		while (fgets(line, sizeof(line), fp)) {
+			if (n == size) {
+				size = size ? size * 2 : 1024;
+				if ((o = realloc(*old, size * sizeof(struct oldtpl))) == NULL) {
+					fclose(fp);
+					*nold = n;
+					return nboots;
+				}
+				*old = o;
+			}
+			o = &(*old)[n];
+			o->text[0] = 0;
+			if (sscanf(line, "%llx %lld %*u %d %63[^\n]", &o->hash, &o->first, &o->error, o->text) >= 3) {
+				n++;
+			}
+		}
+		fclose(fp);
+	}
+	*nold = n;
+
+	return nboots;
+}
+
+static void tpl_compare(FILE *fp, struct oldtpl *old, int nold, int nboots)
+{
+	long long firsts[TPL_BOOTS], usual;
+	struct template *t;
+	int i, j, k, late = 0, vanished = 0, fresh = 0;
+
+	qsort(old, nold, sizeof(struct oldtpl), byhash);
+
+	fprintf(fp, "later than usual (first seen, usual, template):\n");
+	for (i = 0; i < nold; i = j) {
+		for (j = i, k = 0; j < nold && old[j].hash == old[i].hash; j++) {
+			if (k < TPL_BOOTS) {
+				firsts[k++] = old[j].first;
+			}
+		}
+		t = tpl_find(old[i].hash);
+		if (t->hash == 0) {
+			continue;
+		}
+		t->seen = 1;
+		/* only if it is there most of the time */
+		if (k * 2 < nboots) {
+			continue;
+		}
+		qsort(firsts, k, sizeof(long long), bytime);
+		usual = firsts[k / 2];
+		if (t->first > usual + (usual / 4 > TPL_LATE ? usual / 4 : TPL_LATE)) {
+			fprintf(fp, "  %9.3f %9.3f s  %s\n", t->first / 1000.0, usual / 1000.0, t->text);
+			late++;
+		}
+	}
+	if (!late) {
+		fprintf(fp, "  none\n");
+	}
+
+	fprintf(fp, "\nnew error messages (first seen, template):\n");
+	for (i = 0; i < TPL_SLOTS; i++) {
+		if (tpl[i].hash == 0) {
+			continue;
+		}
+		if (!tpl[i].seen && tpl[i].error) {
+			fprintf(fp, "  %9.3f s  %s\n", tpl[i].first / 1000.0, tpl[i].text);
+			fresh++;
+		}
+	}
+	if (!fresh) {
+		fprintf(fp, "  none\n");
+	}
+
+	fprintf(fp, "\ngone, but there in all %d earlier boots:\n", nboots);
+	for (i = 0; i < nold; i = j) {
+		for (j = i; j < nold && old[j].hash == old[i].hash; j++)
+			;
+		if (j - i >= nboots && tpl_find(old[i].hash)->hash == 0) {
+			fprintf(fp, "  %s\n", old[i].text);
+			vanished++;
+		}
+	}
+	if (!vanished) {
+		fprintf(fp, "  none\n");
+	}
+}
+
+/*
+ * Compare with the earlier boots, and keep this one as boot.0.
+ */
+void tpl_finish(void)
+{
+	char path[1024], path2[1024];
+	struct oldtpl *old;
+	FILE *fp;
+	int i, nold, nboots;
+
+	if (tpldir == NULL) {
+		return;
+	}
+
+	nboots = tpl_load(&old, &nold);
+	snprintf(path, sizeof(path), "%s/report", tpldir);
+	if (nboots > 0 && (fp = fopen(path, "w")) != NULL) {
+		fprintf(fp, "%d templates, %lu not tracked, compared with %d earlier boots\n\n",
+				ntpl, tpldropped, nboots);
+		tpl_compare(fp, old, nold, nboots);
+		fclose(fp);
+	}
+	free(old);
+
+	/*
+	 * boot.N-2 -> boot.N-1, ..., boot.0 -> boot.1
+	 */
+	for (i = tplkeep - 1; i > 0; i--) {
+		snprintf(path, sizeof(path), "%s/boot.%d", tpldir, i - 1);
+		snprintf(path2, sizeof(path2), "%s/boot.%d", tpldir, i);
+		rename(path, path2);
+	}
+	snprintf(path, sizeof(path), "%s/boot.0~", tpldir);
+	if ((fp = fopen(path, "w")) == NULL) {
+		return;
+	}
+	for (i = 0; i < TPL_SLOTS; i++) {
+		if (tpl[i].hash) {
+			fprintf(fp, "%016llx %lld %lu %d %s\n", tpl[i].hash, tpl[i].first,
+					tpl[i].count, tpl[i].error, tpl[i].text);
+		}
+	}
+	if (fclose(fp) == 0) {
+		snprintf(path2, sizeof(path2), "%s/boot.0", tpldir);
+		rename(path, path2);
+	}
+}
@@ -0,0 +1,212 @@
+/*
+ * timeline.c	Where did boot time go (-B).
+ *
+ *		Everything is worked out as the lines come in: the phases
+ *		init scripts announce on the control channel ("phase NAME"),
+ *		the longest silences between two lines (with both lines, so
+ *		one can see what we were waiting for) and the seconds with
+ *		the most output. At exit the report is written out; there is
+ *		no second pass over the logfile.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bootlogd.h"
+
+#define TL_PHASES	64	/* phases we keep track of */
+#define TL_GAPS		5	/* longest gaps we report */
+#define TL_BURSTS	5	/* busiest seconds we report */
+#define TL_TEXT		100	/* how much of a line we keep */
+
+struct phase {
+	char name[TL_TEXT];
+	long long start;
+	unsigned long lines;
+};
+
+struct gap {
+	long long len;		/* 0 if unused */
+	long long at;		/* when the silence ended */
+	char before[TL_TEXT];
+	char after[TL_TEXT];
+};
+
+struct burst {
+	long long sec;		/* second since start */
+	unsigned long lines;
+	unsigned long bytes;
+};
+
+static struct phase phases[TL_PHASES];
+static int nphases = 0;
+static struct gap gaps[TL_GAPS];
+static struct burst bursts[TL_BURSTS];
+static struct burst cur;	/* the second we are in */
+static long long tlstart = 0;
+static long long lastline = -1;
+static char lasttext[TL_TEXT];
+static unsigned long tllines = 0;
+
+static void tl_copy(char *dst, const char *src, int len)
+{
+	int i;
+
+	if (len >= TL_TEXT) {
+		len = TL_TEXT - 1;
+	}
+	for (i = 0; i < len; i++) {
+		dst[i] = (src[i] >= ' ' && src[i] != 127) ? src[i] : '?';
+	}
+	dst[len] = 0;
+}
+
+void tl_start(long long now)
+{
+	tlstart = now;
+	strcpy(phases[0].name, "(start)");
+	phases[0].start = now;
+	nphases = 1;
+	cur.sec = 0;
+}
+
+/*
+ * An init script says a new phase begins.
+ */
+void tl_phase(const char *name, long long now)
+{
+	if (name == NULL || *name == 0) {
+		return;
+	}
+	if (nphases == TL_PHASES) {
+		/* keep the last slot for whatever comes last */
+		nphases--;
+	}
+	tl_copy(phases[nphases].name, name, strlen(name));
+	phases[nphases].start = now;
+	phases[nphases].lines = 0;
+	nphases++;
+}
+
+/*
+ * Put the second that just ended among the busiest, if it is.
+ */
+static void tl_burst(void)
+{
+	int i, j;
+
+	for (i = 0; i < TL_BURSTS; i++) {
+		if (cur.bytes > bursts[i].bytes) {
+			for (j = TL_BURSTS - 1; j > i; j--) {
+				bursts[j] = bursts[j - 1];
+			}
+			bursts[i] = cur;
+			break;
+		}
+	}
+}
+
+/*
+ * A line begins at now.
+ */
+void tl_line(const char *text, int len, long long now)
+{
+	long long sec, silence;
+	int i, j;
+
+	if (tlstart == 0) {
+		return;
+	}
+	tllines++;
+	phases[nphases - 1].lines++;
+
+	/*
+	 * Silent gaps, longest first.
+	 */
+	if (lastline >= 0) {
+		silence = now - lastline;
+		for (i = 0; i < TL_GAPS; i++) {
+			if (silence > gaps[i].len) {
+				for (j = TL_GAPS - 1; j > i; j--) {
+					gaps[j] = gaps[j - 1];
+				}
+				gaps[i].len = silence;
+				gaps[i].at = now;
+				strcpy(gaps[i].before, lasttext);
+				tl_copy(gaps[i].after, text, len);
+				break;
+			}
+		}
+	}
+	lastline = now;
+	tl_copy(lasttext, text, len);
+
+	/*
+	 * Output rate, by the second.
+	 */
+	sec = (now - tlstart) / 1000;
+	if (sec != cur.sec) {
+		tl_burst();
+		cur.sec = sec;
+		cur.lines = 0;
+		cur.bytes = 0;
+	}
+	cur.lines++;
+	cur.bytes += len + 1;
+}
+
+static double secs(long long ms)
+{
+	return ms / 1000.0;
+}
+
+/*
+ * Write out the report.
+ */
+void tl_report(const char *file, long long now)
+{
+	struct burst saved[TL_BURSTS];
+	FILE *fp;
+	long long end;
+	int i;
+
+	if (file == NULL || tlstart == 0 || (fp = fopen(file, "w")) == NULL) {
+		return;
+	}
+	/* count the second we are in without closing it */
+	memcpy(saved, bursts, sizeof(saved));
+	tl_burst();
+
+	fprintf(fp, "bootlogd timeline: %.3f s, %lu lines\n", secs(now - tlstart), tllines);
+
+	fprintf(fp, "\nphases (start, duration, lines):\n");
+	for (i = 0; i < nphases; i++) {
+		end = i + 1 < nphases ? phases[i + 1].start : now;
+		fprintf(fp, "  %9.3f %9.3f s %7lu  %s\n", secs(phases[i].start - tlstart),
+				secs(end - phases[i].start), phases[i].lines, phases[i].name);
+	}
+
+	fprintf(fp, "\nlongest silent gaps:\n");
+	for (i = 0; i < TL_GAPS && gaps[i].len > 0; i++) {
+		fprintf(fp, "  %.3f s, ending at %.3f\n", secs(gaps[i].len), secs(gaps[i].at - tlstart));
+		fprintf(fp, "    before: %s\n", gaps[i].before);
+		fprintf(fp, "    after:  %s\n", gaps[i].after);
+	}
+
+	fprintf(fp, "\nbusiest seconds:\n");
+	for (i = 0; i < TL_BURSTS && bursts[i].bytes > 0; i++) {
+		fprintf(fp, "  %lld-%lld s: %lu lines, %lu bytes\n",
+				bursts[i].sec, bursts[i].sec + 1, bursts[i].lines, bursts[i].bytes);
+	}
+
+	fclose(fp);
+	memcpy(bursts, saved, sizeof(saved));
+}
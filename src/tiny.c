@@ -0,0 +1,156 @@
+/*
+ * tiny.c	What the small build ("make tiny") has instead of the rules,
+ *		the control fifo and the reports. Their options are not
+ *		taken in that build (see bootlogd_option()), so all that is
+ *		left to do here is nothing.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <string.h>
+#include "bootlogd.h"
+
+/*
+ * No rules: every line goes through as it is.
+ */
+int rules_bind(void)
+{
+	return 0;
+}
+
+void rules_line(unsigned char *line, int len, int cont, struct ruleres *res)
+{
+	(void)line;
+	(void)len;
+	(void)cont;
+	memset(res, 0, sizeof(*res));
+}
+
+int rules_tail(unsigned char *line, int len)
+{
+	(void)line;
+	(void)len;
+
+	return 0;
+}
+
+void rules_reap(void)
+{
+}
+
+/*
+ * No control fifo.
+ */
+int ctl_fd = -1;
+
+int ctl_open(const char *path)
+{
+	(void)path;
+
+	return -1;
+}
+
+void ctl_read(void)
+{
+}
+
+void ctl_close(void)
+{
+}
+
+/*
+ * No reports.
+ */
+void tl_start(long long now)
+{
+	(void)now;
+}
+
+void tl_line(const char *text, int len, long long now)
+{
+	(void)text;
+	(void)len;
+	(void)now;
+}
+
+void tl_report(const char *file, long long now)
+{
+	(void)file;
+	(void)now;
+}
+
+void units_start(long long now)
+{
+	(void)now;
+}
+
+void units_line(const char *s, int len, long long start, long long now)
+{
+	(void)s;
+	(void)len;
+	(void)start;
+	(void)now;
+}
+
+void units_report(const char *file, long long now)
+{
+	(void)file;
+	(void)now;
+}
+
+void tpl_start(const char *dir, int keep)
+{
+	(void)dir;
+	(void)keep;
+}
+
+void tpl_line(const char *s, int len, int prio, long long now)
+{
+	(void)s;
+	(void)len;
+	(void)prio;
+	(void)now;
+}
+
+void tpl_finish(void)
+{
+}
+
+int lat_fd = -1;
+
+int lat_open(void)
+{
+	return -1;
+}
+
+void lat_read(long long nowus)
+{
+	(void)nowus;
+}
+
+void lat_line(const char *s, int len, long long nowus)
+{
+	(void)s;
+	(void)len;
+	(void)nowus;
+}
+
+void lat_console(long long us)
+{
+	(void)us;
+}
+
+void lat_report(const char *file)
+{
+	(void)file;
+}
+
+void lat_close(void)
+{
+}
@@ -0,0 +1,276 @@
+/*
+ * units.c	How long each service took to start (-U).
+ *
+ *		The init system tells the console when it starts a unit and
+ *		when it is done with it:
+ *
+ *		         Starting foo.service - Foo...
+ *		[  OK  ] Started foo.service - Foo.
+ *		[FAILED] Failed to start foo.service - Foo.
+ *		 * Starting foo ... [ ok ]
+ *
+ *		We pair these up by name as the lines come in. Older systemd
+ *		only prints the description, but it prints the same one both
+ *		times, so that pairs up as well. An OpenRC result printed on
+ *		a line of its own goes to the last unit still starting.
+ *
+ *		Without dependency information the critical path can only
+ *		be guessed: from the unit that finished last, go back to the
+ *		unit that finished last before it started, and so on.
+ *
+ *		This file is part of bootlogd.
+ *		Copyright (C) 2020 Samuel Dionne-Riel
+ *
+ *		This program is free software; you can redistribute it and/or modify
+ *		it under the terms of the GNU General Public License as published by
+ *		the Free Software Foundation; either version 2 of the License, or
+ *		(at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bootlogd.h"
+
+#define MAX_UNITS	512
+#define UNIT_NAME	64
+
+#define UNIT_RUNNING	0
+#define UNIT_OK		1
+#define UNIT_FAILED	2
+
+struct unit {
+	char name[UNIT_NAME];
+	long long start;
+	long long end;
+	int result;		/* UNIT_* */
+};
+
+static struct unit units[MAX_UNITS];
+static int nunits = 0;
+static long long unitstart = 0;
+static unsigned long unitsdropped = 0;
+
+static char *resname[] = { "-", "ok", "failed" };
+
+void units_start(long long now)
+{
+	unitstart = now;
+}
+
+/*
+ * Find text in a line that is not NUL terminated.
+ */
+static const char *find(const char *s, int len, const char *what)
+{
+	return memmem(s, len, what, strlen(what));
+}
+
+/*
+ * The name of a unit, from p up to the end of the line: cut at " - "
+ * (the description), " ..." (OpenRC) or a trailing "..." or ".".
+ */
+static void unitname(char *name, const char *p, const char *end)
+{
+	const char *q;
+	int n;
+
+	while (p < end && *p == ' ') {
+		p++;
+	}
+	if ((q = find(p, end - p, " - ")) != NULL || (q = find(p, end - p, " ...")) != NULL) {
+		end = q;
+	}
+	while (end > p && (end[-1] == '.' || end[-1] == ' ')) {
+		end--;
+	}
+	n = end - p < UNIT_NAME - 1 ? end - p : UNIT_NAME - 1;
+	memcpy(name, p, n);
+	name[n] = 0;
+}
+
+static struct unit *unitfind(const char *name)
+{
+	int i;
+
+	for (i = nunits - 1; i >= 0; i--) {
+		if (units[i].result == UNIT_RUNNING && strcmp(units[i].name, name) == 0) {
+			return &units[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct unit *unitnew(const char *name, long long start)
+{
+	struct unit *u;
+
+	if (nunits == MAX_UNITS) {
+		unitsdropped++;
+		return NULL;
+	}
+	u = &units[nunits++];
+	strcpy(u->name, name);
+	u->start = start;
+	u->end = -1;
+	u->result = UNIT_RUNNING;
+
+	return u;
+}
+
+static void unitdone(const char *name, int result, long long now)
+{
+	struct unit *u;
+
+	if ((u = unitfind(name)) == NULL && (u = unitnew(name, now)) == NULL) {
+		return;
+	}
+	u->end = now;
+	u->result = result;
+}
+
+/*
+ * A complete line, which began at start and ended at now.
+ */
+void units_line(const char *s, int len, long long start, long long now)
+{
+	const char *p, *end = s + len;
+	char name[UNIT_NAME];
+	struct unit *u;
+	int i, ok;
+
+	if (unitstart == 0) {
+		return;
+	}
+
+	/*
+	 * OpenRC, the result may be on the same line.
+	 */
+	ok = find(s, len, "[ ok ]") != NULL;
+	if (ok || find(s, len, "[ !! ]") != NULL) {
+		if ((p = find(s, len, "* Starting ")) != NULL) {
+			unitname(name, p + 11, end);
+			if (unitnew(name, start) != NULL) {
+				unitdone(name, ok ? UNIT_OK : UNIT_FAILED, now);
+			}
+			return;
+		}
+		for (i = nunits - 1; i >= 0; i--) {
+			u = &units[i];
+			if (u->result == UNIT_RUNNING) {
+				u->end = start;
+				u->result = ok ? UNIT_OK : UNIT_FAILED;
+				break;
+			}
+		}
+		return;
+	}
+	if ((p = find(s, len, "* Starting ")) != NULL) {
+		unitname(name, p + 11, end);
+		unitnew(name, start);
+		return;
+	}
+
+	/*
+	 * systemd.
+	 */
+	if ((p = find(s, len, "Failed to start ")) != NULL) {
+		unitname(name, p + 16, end);
+		unitdone(name, UNIT_FAILED, start);
+	}
+	else if ((p = find(s, len, "Started ")) != NULL) {
+		unitname(name, p + 8, end);
+		unitdone(name, UNIT_OK, start);
+	}
+	else if ((p = find(s, len, "Finished ")) != NULL) {
+		unitname(name, p + 9, end);
+		unitdone(name, UNIT_OK, start);
+	}
+	else if ((p = find(s, len, "Starting ")) != NULL) {
+		unitname(name, p + 9, end);
+		if (*name && unitfind(name) == NULL) {
+			unitnew(name, start);
+		}
+	}
+}
+
+static int bylength(const void *a, const void *b)
+{
+	const struct unit *ua = a, *ub = b;
+	long long la = ua->end - ua->start, lb = ub->end - ub->start;
+
+	if (ua->result == UNIT_RUNNING || ub->result == UNIT_RUNNING) {
+		return ua->result == UNIT_RUNNING ? (ub->result == UNIT_RUNNING ? 0 : 1) : -1;
+	}
+
+	return la < lb ? 1 : la > lb ? -1 : 0;
+}
+
+static double secs(long long ms)
+{
+	return ms / 1000.0;
+}
+
+/*
+ * Write out the table, longest first, and the guessed critical path.
+ */
+void units_report(const char *file, long long now)
+{
+	static struct unit sorted[MAX_UNITS];
+	struct unit *u, *last, *path[MAX_UNITS];
+	FILE *fp;
+	int i, n;
+
+	if (file == NULL || unitstart == 0 || (fp = fopen(file, "w")) == NULL) {
+		return;
+	}
+
+	memcpy(sorted, units, nunits * sizeof(struct unit));
+	qsort(sorted, nunits, sizeof(struct unit), bylength);
+	fprintf(fp, "units (start, duration, result):\n");
+	for (i = 0; i < nunits; i++) {
+		u = &sorted[i];
+		if (u->result == UNIT_RUNNING) {
+			fprintf(fp, "  %9.3f         - s  %-6s  %s\n",
+					secs(u->start - unitstart), resname[u->result], u->name);
+		}
+		else {
+			fprintf(fp, "  %9.3f %9.3f s  %-6s  %s\n", secs(u->start - unitstart),
+					secs(u->end - u->start), resname[u->result], u->name);
+		}
+	}
+	if (unitsdropped) {
+		fprintf(fp, "  (%lu more not tracked)\n", unitsdropped);
+	}
+
+	/*
+	 * Walk back from the unit that finished last.
+	 */
+	n = 0;
+	last = NULL;
+	for (;;) {
+		u = NULL;
+		for (i = 0; i < nunits; i++) {
+			if (units[i].result == UNIT_RUNNING || (last &&
+					(units[i].end > last->start || units[i].start >= last->start))) {
+				continue;
+			}
+			if (u == NULL || units[i].end > u->end) {
+				u = &units[i];
+			}
+		}
+		if (u == NULL) {
+			break;
+		}
+		path[n++] = u;
+		last = u;
+	}
+	fprintf(fp, "\ncritical path (approximate, %.3f s since start):\n", secs(now - unitstart));
+	while (n-- > 0) {
+		fprintf(fp, "  %9.3f %9.3f s  %s\n", secs(path[n]->start - unitstart),
+				secs(path[n]->end - path[n]->start), path[n]->name);
+	}
+
+	fclose(fp);
+}